@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "vsfs.h"
+
+// Benchmark harness. Formats a virtual disk, runs the selected
+// workloads and prints one line of key=value pairs per workload, so
+// that runs of different builds can be compared with a script.
+
+#define MAX_THREADS 64
+
+char vdiskname[200] = "benchdisk";
+int m = 26;
+int recordSize = 4096;
+int smallSize = 64;
+int ops = 1000; // per thread
+int files = 8; // per thread, for churn and many_open
+int threads = 1;
+int extents = 0;
+int checksums = 0;
+int mountMode = MOUNT_BUFFERED;
+char workloads[400] = "seq_append,small_append,seq_read,rand_read,churn,many_open";
+
+typedef struct {
+    int id;
+    int (*run)(int id, long long *lat, long long *bytes); // returns ops done
+    long long *lat; // per-op latency, ns
+    int done;
+    long long bytes;
+} Worker;
+
+pthread_barrier_t startLine;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Make sure file name exists with at least size bytes, unmeasured
+static void prepare_file(char *name, int size) {
+    int fd = vsopen(name, MODE_READ);
+    if (fd >= 0) {
+        int have = vssize(fd);
+        vsclose(fd);
+        if (have >= size)
+            return;
+        vsdelete(name);
+    }
+    char *buf = calloc(1, recordSize);
+    vscreate(name);
+    fd = vsopen(name, MODE_APPEND);
+    for (int done = 0; done < size; done += recordSize)
+        vsappend(fd, buf, recordSize);
+    vsclose(fd);
+    free(buf);
+}
+
+static int append_records(char *name, int size, long long *lat, long long *bytes) {
+    char *buf = malloc(size);
+    memset(buf, 'b', size);
+    vscreate(name);
+    int fd = vsopen(name, MODE_APPEND);
+    int i;
+    for (i = 0; i < ops; i++) {
+        long long t0 = now_ns();
+        int n = vsappend(fd, buf, size);
+        lat[i] = now_ns() - t0;
+        if (n != size)
+            break;
+        *bytes += n;
+    }
+    vsclose(fd);
+    free(buf);
+    return i;
+}
+
+static int seq_append(int id, long long *lat, long long *bytes) {
+    char name[32];
+    sprintf(name, "seq%d", id);
+    return append_records(name, recordSize, lat, bytes);
+}
+
+static int small_append(int id, long long *lat, long long *bytes) {
+    char name[32];
+    sprintf(name, "small%d", id);
+    return append_records(name, smallSize, lat, bytes);
+}
+
+static int seq_read(int id, long long *lat, long long *bytes) {
+    char name[32];
+    sprintf(name, "seq%d", id);
+    char *buf = malloc(recordSize);
+    int fd = vsopen(name, MODE_READ);
+    int i;
+    for (i = 0; i < ops; i++) {
+        long long t0 = now_ns();
+        int n = vsread(fd, buf, recordSize);
+        lat[i] = now_ns() - t0;
+        if (n <= 0)
+            break;
+        *bytes += n;
+    }
+    vsclose(fd);
+    free(buf);
+    return i;
+}
+
+static int rand_read(int id, long long *lat, long long *bytes) {
+    char name[32];
+    sprintf(name, "seq%d", id);
+    char *buf = malloc(recordSize);
+    unsigned int seed = id + 1;
+    int fd = vsopen(name, MODE_READ);
+    int records = vssize(fd) / recordSize;
+    int i;
+    for (i = 0; i < ops && records > 0; i++) {
+        int offset = (rand_r(&seed) % records) * recordSize;
+        long long t0 = now_ns();
+        int n = vspread(fd, buf, recordSize, offset);
+        lat[i] = now_ns() - t0;
+        if (n <= 0)
+            break;
+        *bytes += n;
+    }
+    vsclose(fd);
+    free(buf);
+    return i;
+}
+
+// Create, write one record, close and delete a file per op
+static int churn(int id, long long *lat, long long *bytes) {
+    char name[32];
+    char *buf = malloc(recordSize);
+    memset(buf, 'c', recordSize);
+    int i;
+    for (i = 0; i < ops; i++) {
+        sprintf(name, "churn%d_%d", id, i % files);
+        long long t0 = now_ns();
+        if (vscreate(name) < 0)
+            break;
+        int fd = vsopen(name, MODE_APPEND);
+        int n = vsappend(fd, buf, recordSize);
+        vsclose(fd);
+        vsdelete(name);
+        lat[i] = now_ns() - t0;
+        if (n != recordSize)
+            break;
+        *bytes += n;
+    }
+    free(buf);
+    return i;
+}
+
+// Keep files open at once and append to them in turn
+static int many_open(int id, long long *lat, long long *bytes) {
+    char name[32];
+    char *buf = malloc(recordSize);
+    memset(buf, 'o', recordSize);
+    int *fds = malloc(files * sizeof(int));
+    int open = 0;
+    for (int j = 0; j < files; j++) {
+        sprintf(name, "open%d_%d", id, j);
+        vscreate(name);
+        int fd = vsopen(name, MODE_APPEND);
+        if (fd >= 0)
+            fds[open++] = fd;
+    }
+    int i;
+    for (i = 0; i < ops && open > 0; i++) {
+        long long t0 = now_ns();
+        int n = vsappend(fds[i % open], buf, recordSize);
+        lat[i] = now_ns() - t0;
+        if (n != recordSize)
+            break;
+        *bytes += n;
+    }
+    for (int j = 0; j < open; j++)
+        vsclose(fds[j]);
+    for (int j = 0; j < files; j++) {
+        sprintf(name, "open%d_%d", id, j);
+        vsdelete(name);
+    }
+    free(fds);
+    free(buf);
+    return i;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = (Worker *)arg;
+    pthread_barrier_wait(&startLine);
+    w->done = w->run(w->id, w->lat, &w->bytes);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_workload(char *name, int (*run)(int, long long *, long long *)) {
+    Worker w[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    struct vsstats before, after;
+
+    if (run == seq_read || run == rand_read) {
+        char file[32];
+        for (int i = 0; i < threads; i++) {
+            sprintf(file, "seq%d", i);
+            prepare_file(file, ops * recordSize);
+        }
+    }
+
+    pthread_barrier_init(&startLine, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        w[i].id = i;
+        w[i].run = run;
+        w[i].lat = malloc(ops * sizeof(long long));
+        w[i].done = 0;
+        w[i].bytes = 0;
+        pthread_create(&tid[i], NULL, worker_main, &w[i]);
+    }
+    vsstats(&before);
+    long long t0 = now_ns();
+    pthread_barrier_wait(&startLine);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    double secs = (now_ns() - t0) / 1e9;
+    vsstats(&after);
+    pthread_barrier_destroy(&startLine);
+
+    // Merge the latencies of all threads for the percentiles
+    long long total = 0;
+    long long bytes = 0;
+    for (int i = 0; i < threads; i++) {
+        total += w[i].done;
+        bytes += w[i].bytes;
+    }
+    long long *lat = malloc((total > 0 ? total : 1) * sizeof(long long));
+    long long k = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(&lat[k], w[i].lat, w[i].done * sizeof(long long));
+        k += w[i].done;
+        free(w[i].lat);
+    }
+    qsort(lat, total, sizeof(long long), cmp_ll);
+    double p50 = total > 0 ? lat[total * 50 / 100] / 1e3 : 0;
+    double p99 = total > 0 ? lat[total * 99 / 100] / 1e3 : 0;
+    free(lat);
+
+    printf("workload=%s threads=%d ops=%lld bytes=%lld secs=%.6f ops_per_sec=%.1f mb_per_sec=%.2f "
+           "p50_us=%.2f p99_us=%.2f syscalls=%lld block_reads=%lld block_writes=%lld "
+           "cache_hits=%lld cache_misses=%lld fat_hops=%lld\n",
+           name, threads, total, bytes, secs,
+           secs > 0 ? total / secs : 0, secs > 0 ? bytes / secs / (1024 * 1024) : 0,
+           p50, p99,
+           after.syscalls - before.syscalls,
+           after.blockReads - before.blockReads,
+           after.blockWrites - before.blockWrites,
+           after.cacheHits - before.cacheHits,
+           after.cacheMisses - before.cacheMisses,
+           after.fatHops - before.fatHops);
+    fflush(stdout);
+}
+
+static void usage() {
+    printf("usage: bench [-d vdisk] [-m m] [-r record] [-s small] [-n ops] [-f files]\n"
+           "             [-t threads] [-w workload,...] [-e] [-c] [-M]\n"
+           "  -e  format with extents   -c  format with checksums   -M  mount with MOUNT_MMAP\n"
+           "  workloads: seq_append small_append seq_read rand_read churn many_open\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "d:m:r:s:n:f:t:w:ecM")) != -1) {
+        switch (opt) {
+        case 'd': snprintf(vdiskname, sizeof(vdiskname), "%s", optarg); break;
+        case 'm': m = atoi(optarg); break;
+        case 'r': recordSize = atoi(optarg); break;
+        case 's': smallSize = atoi(optarg); break;
+        case 'n': ops = atoi(optarg); break;
+        case 'f': files = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'w': snprintf(workloads, sizeof(workloads), "%s", optarg); break;
+        case 'e': extents = 1; break;
+        case 'c': checksums = 1; break;
+        case 'M': mountMode = MOUNT_MMAP; break;
+        default: usage();
+        }
+    }
+    if (threads < 1 || threads > MAX_THREADS || ops < 1 || files < 1
+        || recordSize < 1 || smallSize < 1)
+        usage();
+
+    if (vsformatx(vdiskname, m, (extents ? FORMAT_EXTENTS : 0) | (checksums ? FORMAT_CHECKSUMS : 0)) != 0) {
+        printf("could not format %s\n", vdiskname);
+        exit(1);
+    }
+    if (vsmount_mode(vdiskname, mountMode) != 0) {
+        printf("could not mount %s\n", vdiskname);
+        exit(1);
+    }
+    printf("config vdisk=%s m=%d record=%d small=%d ops=%d files=%d threads=%d extents=%d checksums=%d mmap=%d\n",
+           vdiskname, m, recordSize, smallSize, ops, files, threads, extents, checksums,
+           mountMode == MOUNT_MMAP);
+
+    char *name = strtok(workloads, ",");
+    while (name != NULL) {
+        if (strcmp(name, "seq_append") == 0)
+            run_workload(name, seq_append);
+        else if (strcmp(name, "small_append") == 0)
+            run_workload(name, small_append);
+        else if (strcmp(name, "seq_read") == 0)
+            run_workload(name, seq_read);
+        else if (strcmp(name, "rand_read") == 0)
+            run_workload(name, rand_read);
+        else if (strcmp(name, "churn") == 0)
+            run_workload(name, churn);
+        else if (strcmp(name, "many_open") == 0)
+            run_workload(name, many_open);
+        else
+            printf("unknown workload %s\n", name);
+        name = strtok(NULL, ",");
+    }
+
+    vsumount();
+    return 0;
+}
@@ -9,9 +9,19 @@ int main(int argc, char **argv)
     int ret;
     char vdiskname[200];
     int m; 
+    int flags = 0;
 
-    if (argc != 3) {
-	printf ("usage: create_format <vdiskname> <m>\n"); 
+    int bad = argc < 3;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "extents") == 0)
+            flags |= FORMAT_EXTENTS;
+        else if (strcmp(argv[i], "checksums") == 0)
+            flags |= FORMAT_CHECKSUMS;
+        else
+            bad = 1;
+    }
+    if (bad) {
+	printf ("usage: create_format <vdiskname> <m> [extents] [checksums]\n"); 
 	exit(1); 
     }
 
@@ -20,7 +30,7 @@ int main(int argc, char **argv)
     
     printf ("started\n"); 
     
-    ret  = vsformat (vdiskname, m); 
+    ret  = vsformatx (vdiskname, m, flags); 
     if (ret != 0) {
         printf ("there was an error in creating the disk\n");
         exit(1);
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "vsfs.h"
+
+// Rewrite each fragmented file of a virtual disk into one run of
+// blocks. The disk must not be mounted by anyone else.
+
+int main(int argc, char **argv)
+{
+    int ret;
+    char vdiskname[200];
+
+    if (argc != 2) {
+	printf ("usage: vsdefrag <vdiskname>\n");
+	exit(1);
+    }
+
+    snprintf (vdiskname, sizeof(vdiskname), "%s", argv[1]);
+
+    printf ("started\n");
+
+    if (vsmount (vdiskname) != 0) {
+        printf ("could not mount %s\n", vdiskname);
+        exit(1);
+    }
+
+    ret = vsdefrag ();
+    if (vsumount () != 0 || ret < 0) {
+        printf ("there was an error in defragmenting the disk\n");
+        exit(1);
+    }
+
+    printf ("disk defragmented. %s %d files moved\n", vdiskname, ret);
+    return 0;
+}
@@ -1,559 +1,5333 @@
+#define _GNU_SOURCE // fallocate
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <math.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
 #include "vsfs.h"
 
 #define SUPERBLOCK_SIZE_IN_BLOCKS 1
-#define FAT_SIZE_IN_BLOCKS 32
-#define ROOT_DIR_SIZE_IN_BLOCKS 8
 
-#define FAT_TABLE_LENGTH 16384 // BLOCKSIZE * FAT_SIZE_IN_BLOCKS / 4 
-#define ROOT_DIR_LENGTH 128
+// Fixed layout of images formatted before the superblock recorded it
+#define LEGACY_FAT_SIZE_IN_BLOCKS 32
+#define LEGACY_ROOT_DIR_SIZE_IN_BLOCKS 8
+#define LEGACY_FAT_TABLE_LENGTH 16384 // BLOCKSIZE * FAT_SIZE_IN_BLOCKS / 4 
+#define LEGACY_METADATA_OFFSET 41 // since first 41 blocks are for metadata
+
+#define VSFS_MAGIC 0x56534653 // "VSFS", marks a superblock that records the layout
+#define VSFS_VERSION 8 // 3: inline small files, 4: directory extension blocks, 5: metadata journal,
+                       // 6: block reference counts for clones, 7: block checksums,
+                       // 8: staged journal checkpoints
+#define MIN_ROOT_DIR_LENGTH 128
+#define MAX_ROOT_DIR_LENGTH 65536
+#define BLOCKS_PER_DIR_ENTRY 256 // vsformat sizes the root directory by this ratio
+#define FD_CHUNK 64 // open file table entries allocated at a time
+#define MAX_OPEN_FILES 65536
+#define MAX_DIR_EXT_BLOCKS 65536 // directory blocks chained after the root directory
+#define JOURNAL_MAGIC 0x564A4E4C // "VJNL", marks journal header and transaction blocks
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024 // vsformat gives the journal one block per 1024 disk blocks
+#define MAX_EXTENT_BUFS 256 // extent blocks held back by the journal before a checkpoint
 
 #define MAX_FILENAME_LENGTH 30
-#define METADATA_OFFSET 41 // since first 41 blocks are for metadata
+#define FAT_ENTRIES_PER_BLOCK (BLOCKSIZE / sizeof(FatEntry))
+#define DIR_ENTRIES_PER_BLOCK (BLOCKSIZE / sizeof(DirectoryEntry))
+
+#define DEFAULT_CACHE_SIZE_IN_BLOCKS 64 // override with VSFS_CACHE_BLOCKS at mount time
+#define DEFAULT_READAHEAD_BLOCKS 8 // override with VSFS_READAHEAD_BLOCKS at mount time
+#define DEFAULT_FAT_PAGES 256 // resident FAT blocks, override with VSFS_FAT_PAGES at mount time
+#define MAX_IO_SLICES 64 // iovecs handed to one preadv/pwritev call
+#define SKIP_INTERVAL 32 // blocks between entries of an open file's skip index
+#define MAX_PREALLOC_BLOCKS 1024 // largest run an extent-mode append reserves ahead
+#define DEFAULT_TAIL_FLUSH_BYTES BLOCKSIZE // override with VSFS_TAIL_FLUSH_BYTES at mount time
+#define DEFAULT_TAIL_FLUSH_COUNT 0 // appends, override with VSFS_TAIL_FLUSH_COUNT; 0 for no limit
+#define DEFAULT_TAIL_FLUSH_MS 0 // override with VSFS_TAIL_FLUSH_MS; 0 for no limit
+#define DEFAULT_ASYNC_THREADS 4 // override with VSFS_ASYNC_THREADS
+#define ASYNC_MAX_REQUESTS 1024 // async requests in flight at once
+#define DEFRAG_BUFFER_BLOCKS 512 // blocks vsdefrag moves with one read and one write
+#define SCRUB_CHUNK_BLOCKS 256 // blocks a vsfsck scrub thread reads with one call
+#define MAX_SCRUB_THREADS 64
+
+// Diagnostics compiled in: 0 prints nothing, 1 errors and warnings,
+// 2 also progress and per-block traces. Set with make LOG_LEVEL=n.
+#ifndef VSFS_LOG_LEVEL
+#define VSFS_LOG_LEVEL 1
+#endif
+#define LOG_ERROR 1
+#define LOG_DEBUG 2
+#define vs_log(level, ...) do { if ((level) <= VSFS_LOG_LEVEL) printf(__VA_ARGS__); } while (0)
 
 // globals  =======================================
 int vs_fd; // file descriptor of the Linux file that acts as virtual disk.
               // this is not visible to an application.
+char *vs_map = NULL; // whole virtual disk when mounted with MOUNT_MMAP
+size_t vs_mapSize = 0;
+char *mapDirty = NULL; // per disk block, written through vs_map since last sync
+struct vsstats stats; // counters since vsmount, see vsstats()
 // ========================================================
 
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
 
 // read block k from disk (virtual disk) into buffer block.
 // size of the block is BLOCKSIZE.
 // space for block must be allocated outside of this function.
 // block numbers start from 0 in the virtual disk. 
-int read_block (void *block, int k)
+int disk_read_block (void *block, int k)
 {
     int n;
-    int offset;
+    off_t offset;
 
-    offset = k * BLOCKSIZE;
-    lseek(vs_fd, (off_t) offset, SEEK_SET);
-    n = read (vs_fd, block, BLOCKSIZE);
-    printf("read data = %d", n);
+    // positioned I/O: threads share vs_fd without sharing a file offset
+    offset = (off_t) k * BLOCKSIZE;
+    n = pread (vs_fd, block, BLOCKSIZE, offset);
+    STAT_ADD(blockReads, 1);
+    STAT_ADD(syscalls, 1);
+    vs_log(LOG_DEBUG, "read data = %d", n);
     if (n != BLOCKSIZE) {
-	printf ("read error\n");
+	vs_log(LOG_ERROR, "read error\n");
+	return -1;
+    }
+    return (0); 
+}
+
+// read count consecutive blocks starting at block k with a single pread.
+int disk_read_blocks (void *blocks, int k, int count)
+{
+    ssize_t n;
+    off_t offset;
+
+    offset = (off_t) k * BLOCKSIZE;
+    n = pread (vs_fd, blocks, (size_t) count * BLOCKSIZE, offset);
+    STAT_ADD(blockReads, count);
+    STAT_ADD(syscalls, 1);
+    vs_log(LOG_DEBUG, "read data = %zd", n);
+    if (n != (ssize_t) count * BLOCKSIZE) {
+	vs_log(LOG_ERROR, "read error\n");
 	return -1;
     }
     return (0); 
 }
 
 // write block k into the virtual disk. 
-int write_block (void *block, int k)
+int disk_write_block (void *block, int k)
 {
     int n;
-    int offset;
+    off_t offset;
 
-    offset = k * BLOCKSIZE;
-    lseek(vs_fd, (off_t) offset, SEEK_SET);
-    n = write (vs_fd, block, BLOCKSIZE);
+    offset = (off_t) k * BLOCKSIZE;
+    n = pwrite (vs_fd, block, BLOCKSIZE, offset);
+    STAT_ADD(blockWrites, 1);
+    STAT_ADD(syscalls, 1);
     if (n != BLOCKSIZE) {
-	printf ("write error\n");
+	vs_log(LOG_ERROR, "write error\n");
 	return (-1);
     }
     return 0; 
 }
 
-///////////////////////////////////////////////////////////////
-
-typedef struct {
-    int blockSize;
-    int fatSize;
-    int rootDirSize;
-    int diskSize;
-
-    // Padding to make the structure exactly one block
-    char padding[2032];
-} SuperBlock;
+// write count consecutive blocks starting at block k with a single pwrite.
+int disk_write_blocks (void *blocks, int k, int count)
+{
+    ssize_t n;
+    off_t offset;
 
-typedef struct {
-    char filename[MAX_FILENAME_LENGTH];
-    int fileSize;
-    int startBlock;
-    
-    // Padding to make the structure 128 bytes
-    char padding[88];
-} DirectoryEntry;
+    offset = (off_t) k * BLOCKSIZE;
+    n = pwrite (vs_fd, blocks, (size_t) count * BLOCKSIZE, offset);
+    STAT_ADD(blockWrites, count);
+    STAT_ADD(syscalls, 1);
+    if (n != (ssize_t) count * BLOCKSIZE) {
+	vs_log(LOG_ERROR, "write error\n");
+	return (-1);
+    }
+    return 0;
+}
 
-#define FAT_UNALLOCATED -1 // fat entry is unallocated
-#define FAT_NO_NEXT -2 // fat entry is allocated but has no next entry (tail of the list)
+/********************************************************************
+    Statistics
 
-typedef struct {
-    int next; // Pointer to the next cluster
-    // next = FAT_UNALLOCATED for unallocated
-    // next = FAT_NO_NEXT for allocated but next cluster is empty
-} FatEntry;
+    Counters are bumped with relaxed atomic adds wherever the work
+    happens and reset by vsmount. Each API call also records its
+    latency in a power-of-two histogram. With VSFS_STATS_INTERVAL set
+    to n at mount, a thread prints the counters to stderr every n
+    seconds until vsumount.
+********************************************************************/
+static const char *statOpNames[VSOP_COUNT] = {
+    "create", "open", "close", "read", "append", "delete", "sync", "clone"
+};
 
-FatEntry *fat;
-SuperBlock superblock;
-DirectoryEntry *rootDir;
+pthread_t statsThread;
+int statsInterval = 0; // seconds, 0 when no dump thread runs
+int statsStopping = 0;
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t statsStop = PTHREAD_COND_INITIALIZER;
 
-typedef struct {
-    int fd; // File descriptor returned from open()
-    char filename[MAX_FILENAME_LENGTH];
-    int mode; // MODE_READ or MODE_APPEND
-    
-    // Add other attributes if necessary
-} OpenFileEntry;
+static long long stats_begin() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-OpenFileEntry openFileTable[16]; 
+// Count one call of op that moved bytes bytes and started at start
+static void stats_end(int op, long long start, int bytes) {
+    long long us = (stats_begin() - start) / 1000;
+    int bucket = us > 0 ? 64 - __builtin_clzll((unsigned long long) us) : 0;
+    if (bucket >= VSSTATS_BUCKETS)
+        bucket = VSSTATS_BUCKETS - 1;
+    STAT_ADD(calls[op], 1);
+    if (bytes > 0)
+        STAT_ADD(bytes[op], bytes);
+    STAT_ADD(latency[op][bucket], 1);
+}
 
-// typedef struct {
-//     char* data;
-// } DataBlock;
-// DataBlock *dataBlocks;
+int vsstats(struct vsstats *st) {
+    if (st == NULL)
+        return -1;
+    // Every field is a long long counter; copy them one by one
+    long long *src = (long long *) &stats;
+    long long *dst = (long long *) st;
+    for (size_t i = 0; i < sizeof(struct vsstats) / sizeof(long long); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return 0;
+}
 
-/********************************************************************
-    Helper functions, not called directly by applications
-********************************************************************/
-// Find a free block in the FAT table
-int find_free_block() {
-    // Iterate through the FAT table to find the first available block
-    for (int i = 0; i < FAT_TABLE_LENGTH; i++) {
-        if (fat[i].next == FAT_UNALLOCATED) {
-            // Mark the block as allocated in the FAT table, but has no next entry yet!
-            fat[i].next = FAT_NO_NEXT;
-            return i;
+static void stats_print(FILE *out) {
+    struct vsstats st;
+    vsstats(&st);
+    long long calls = 0;
+    for (int op = 0; op < VSOP_COUNT; op++)
+        calls += st.calls[op];
+    fprintf(out, "vsfs blocks read=%lld written=%lld syscalls=%lld cache hits=%lld misses=%lld\n",
+            st.blockReads, st.blockWrites, st.syscalls, st.cacheHits, st.cacheMisses);
+    fprintf(out, "vsfs fat hops=%lld per call=%.2f alloc calls=%lld scan words=%lld\n",
+            st.fatHops, calls > 0 ? (double) st.fatHops / calls : 0.0,
+            st.allocCalls, st.allocScanWords);
+    fprintf(out, "vsfs journal commits=%lld checkpoints=%lld\n", st.commits, st.checkpoints);
+    fprintf(out, "vsfs hole punches=%lld reclaimed blocks=%lld cow copies=%lld\n", st.punches, st.reclaimedBlocks,
+            st.cowCopies);
+    for (int op = 0; op < VSOP_COUNT; op++) {
+        if (st.calls[op] == 0)
+            continue;
+        fprintf(out, "vsfs %s calls=%lld bytes=%lld latency_us", statOpNames[op],
+                st.calls[op], st.bytes[op]);
+        for (int b = 0; b < VSSTATS_BUCKETS; b++) {
+            if (st.latency[op][b] > 0)
+                fprintf(out, " <%lld:%lld", 1LL << b, st.latency[op][b]);
         }
+        fprintf(out, "\n");
     }
-    return -1; // No free blocks available
-}
-    
-// Check if the file descriptor is valid
-int checkFdValidity(int fd){
-    if (fd < 0 || fd >= ROOT_DIR_LENGTH || openFileTable[fd].fd == -1) {
-        return -1;
-    }
-    return fd;
+    fflush(out);
 }
 
-int find_file_by_name(const char *filename) {
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        if (strcmp(rootDir[i].filename, filename) == 0) {
-            return i; // File found, return its index
-        }
+static void *stats_dumper(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&statsLock);
+    while (!statsStopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += statsInterval;
+        pthread_cond_timedwait(&statsStop, &statsLock, &deadline);
+        if (!statsStopping)
+            stats_print(stderr);
     }
-    return -1; // File not found
+    pthread_mutex_unlock(&statsLock);
+    return NULL;
 }
 
-/**********************************************************************
-   The following functions are to be called by applications directly. 
-***********************************************************************/
+// Reset the counters and start the dump thread if one is asked for
+void stats_start() {
+    memset(&stats, 0, sizeof(stats));
+    char *env = getenv("VSFS_STATS_INTERVAL");
+    statsInterval = env != NULL ? atoi(env) : 0;
+    statsStopping = 0;
+    if (statsInterval > 0 && pthread_create(&statsThread, NULL, stats_dumper, NULL) != 0)
+        statsInterval = 0;
+}
 
-int vsformat (char *vdiskname, unsigned int m)
-{
-    char command[1000];
-    int size;
-    int num = 1;
-    int count;
+// Stop the dump thread after a final report
+void stats_stop() {
+    if (statsInterval <= 0)
+        return;
+    pthread_mutex_lock(&statsLock);
+    statsStopping = 1;
+    pthread_cond_signal(&statsStop);
+    pthread_mutex_unlock(&statsLock);
+    pthread_join(statsThread, NULL);
+    stats_print(stderr);
+    statsInterval = 0;
+}
 
-    size  = num << m;
-    count = size / BLOCKSIZE;
-    printf ("%d %d", m, size);
-    sprintf (command, "dd if=/dev/zero of=%s bs=%d count=%d",
-             vdiskname, BLOCKSIZE, count);
-    printf ("executing command = %s\n", command);
-    system (command);
-
-    printf("OPENING VS_FD\n");
-    // Open the virtual disk for read and write
-    vs_fd = open(vdiskname, O_RDWR);
+/********************************************************************
+    Block cache
 
-    printf("INITIALIZING SUPERBLOCK\n");
-    // Initialize superblock
-    superblock.blockSize = BLOCKSIZE;
-    superblock.fatSize = FAT_SIZE_IN_BLOCKS;
-    superblock.rootDirSize = ROOT_DIR_SIZE_IN_BLOCKS;
-    superblock.diskSize = size;
-    printf("INITIALIZED SUPERBLOCK\n");
-    printf("Size of SuperBlock: %lu bytes\n", sizeof(SuperBlock));    
-
-    printf("WRITING SUPERBLOCK\n");
-    // Write superblock to the virtual disk (block 0)
-    write_block(&superblock, 0);
-    printf("WROTE SUPERBLOCK\n");
-
-    // Initialize FAT table
-    printf("INITIALIZING FAT TABLE\n");
-    printf("Size of FatEntry: %lu bytes\n", sizeof(FatEntry));    
-    fat = (FatEntry *)malloc(FAT_TABLE_LENGTH * sizeof(FatEntry));
-    for (int i = 0; i < FAT_TABLE_LENGTH; i++) {
-        fat[i].next = FAT_UNALLOCATED; // Mark all entries as unallocated
-    }
-    printf("INITIALIZED FAT TABLE\n");
-
-    printf("WRITING FAT TABLE\n");
-    // Write FAT table to the virtual disk (blocks 1 to FAT_SIZE)
-    for (int i = 1; i <= FAT_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the FAT entries for this block
-        int startIdx = (i - 1) * (BLOCKSIZE / sizeof(FatEntry));
-        write_block(&fat[startIdx], i);
-    }    
-    printf("WROTE FAT TABLE\n");
-
-    printf("INITIALIZING ROOT DIRECTORY\n");
-    printf("Size of directoryEntry: %lu bytes\n", sizeof(DirectoryEntry));    
-    // Initialize root directory
-    rootDir = (DirectoryEntry *)malloc(ROOT_DIR_LENGTH * sizeof(DirectoryEntry));
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        strcpy(rootDir[i].filename, "\0"); // Set filename to "\0" to mark as empty slot
-        rootDir[i].fileSize = 0;
-        rootDir[i].startBlock = FAT_UNALLOCATED;
-        // Initialize any other attributes if necessary
-    }
-    printf("INITIALIZED ROOT DIRECTORY\n");
-
-    printf("WRITING ROOT DIR\n");
-    // Write root directory to the virtual disk (blocks FAT_SIZE+1 to FAT_SIZE+ROOT_DIR_SIZE)
-    for (int i = FAT_SIZE_IN_BLOCKS + 1; i <= FAT_SIZE_IN_BLOCKS + ROOT_DIR_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the directory entries for this block
-        int startIdx = (i - (FAT_SIZE_IN_BLOCKS + 1)) * (BLOCKSIZE / sizeof(DirectoryEntry));
-        write_block(&rootDir[startIdx], i);
-    }    
-    printf("WROTE ROOT DIRR\n");
-
-    printf("INITIALIZING OPEN FILE TABLE\n");
-    // Initialize open file table
-    for (int i = 0; i < 16; i++){
-        openFileTable[i].fd = -1; //no open files initially
-    }
-    printf("INITIALIZED OPEN FILE TABLE\n");
-
-    // Initialize data blocks
-    // dataBlocks = (DataBlock *)malloc(size - (41 * BLOCKSIZE)); //since first 41 blocks are for metadata
-    // Write data blocks to the virtual disk 
-    // for (int i = FAT_SIZE_IN_BLOCKS + ROOT_DIR_SIZE_IN_BLOCKS + 1; i <= (size/BLOCKSIZE) - 41; i++) {
-    //     write_block(&dataBlocks, i);
-    // }
-
-    printf("CLOSING VS_FD\n");
-    close(vs_fd);
+    An LRU cache of disk blocks sits between read_block/write_block
+    and the virtual disk. Writes only dirty the cached copy; dirty
+    blocks go to disk when they are evicted, on vsclose and on
+    vsumount. The cache is created by vsmount; while it does not
+    exist (e.g. during vsformat) block I/O goes straight to disk.
 
-    return (0); 
-}
+    cacheLock protects the list and hash. Misses are read from disk
+    without holding it; callers never read a block while another
+    thread writes it, because vsread and vsappend on one file exclude
+    each other through the open file's lock.
+********************************************************************/
+typedef struct CacheEntry {
+    int block; // disk block held by this entry, -1 if the entry is empty
+    int dirty; // 1 if data differs from the copy on disk
+    struct CacheEntry *prev; // LRU list, head is the most recently used
+    struct CacheEntry *next;
+    struct CacheEntry *hashNext; // chain in cacheHash
+    char data[BLOCKSIZE];
+} CacheEntry;
 
+CacheEntry *cacheEntries = NULL;
+int cacheSize = 0; // number of entries, 0 when there is no cache
+CacheEntry **cacheHash = NULL;
+int cacheHashSize = 0; // power of two
+CacheEntry *lruHead = NULL;
+CacheEntry *lruTail = NULL;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
 
-int  vsmount (char *vdiskname)
-{
-    // open the Linux file vdiskname and in this
-    // way make it ready to be used for other operations.
-    // vs_fd is global; hence other function can use it. 
-    vs_fd = open(vdiskname, O_RDWR);
-    // load (chache) the superblock info from disk (Linux file) into memory
-    printf("vs_fd has been opened: %d \n", vs_fd);
-    printf("VSMOUNT: READING SUPERBLOCK \n");
-    read_block(&superblock, 0);
-    printf("VSMOUNT: FINISHED READING SUPERBLOCK \n");
-
-    printf("VSMOUNT: READING FAT \n");
-    // Read FAT table (blocks 1 to FAT_SIZE)
-    for (int i = 1; i <= FAT_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the FAT entries for this block
-        //int startIdx = (i - 1) * (BLOCKSIZE / sizeof(FatEntry));
-        //read_block(&fat[startIdx], i);
-        read_block(&fat, i);
-    }    
-    printf("VSMOUNT: FINISHED READING FAT \n");
-
-    printf("VSMOUNT: READING DIRECTORY \n");
-    // Read root directory
-    for (int i = FAT_SIZE_IN_BLOCKS + 1; i <= FAT_SIZE_IN_BLOCKS + ROOT_DIR_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the directory entries for this block
-        // int startIdx = (i - (FAT_SIZE_IN_BLOCKS + 1)) * (BLOCKSIZE / sizeof(DirectoryEntry));
-        // read_block(&rootDir[startIdx], i);
-        read_block(&rootDir, i);
-    }    
-    printf("VSMOUNT: FINISHED READING DIRECTORY \n");
-    
-    return(0);
+static int cache_hash(int k) {
+    return (int) (((unsigned int) k * 2654435761u) & (cacheHashSize - 1));
 }
 
+static void lru_unlink(CacheEntry *e) {
+    if (e->prev) e->prev->next = e->next; else lruHead = e->next;
+    if (e->next) e->next->prev = e->prev; else lruTail = e->prev;
+    e->prev = e->next = NULL;
+}
 
-int vsumount ()
-{
-    // Write superblock to the virtual disk file (block 0)
-    write_block(&superblock, 0);
+static void lru_push_front(CacheEntry *e) {
+    e->prev = NULL;
+    e->next = lruHead;
+    if (lruHead) lruHead->prev = e;
+    lruHead = e;
+    if (lruTail == NULL) lruTail = e;
+}
 
-    // Write FAT table to the virtual disk (blocks 1 to FAT_SIZE)
-    for (int i = 1; i <= FAT_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the FAT entries for this block
-        int startIdx = (i - 1) * (BLOCKSIZE / sizeof(FatEntry));
-        write_block(&fat[startIdx], i);
-    }    
+static void cache_hash_remove(CacheEntry *e) {
+    CacheEntry **p = &cacheHash[cache_hash(e->block)];
+    while (*p != NULL && *p != e)
+        p = &(*p)->hashNext;
+    if (*p == e)
+        *p = e->hashNext;
+    e->hashNext = NULL;
+}
 
-    // Write root directory to the virtual disk (blocks FAT_SIZE+1 to FAT_SIZE+ROOT_DIR_SIZE)
-    for (int i = FAT_SIZE_IN_BLOCKS + 1; i <= FAT_SIZE_IN_BLOCKS + ROOT_DIR_SIZE_IN_BLOCKS; i++) {
-        // Calculate the starting index of the directory entries for this block
-        int startIdx = (i - (FAT_SIZE_IN_BLOCKS + 1)) * (BLOCKSIZE / sizeof(DirectoryEntry));
-        write_block(&rootDir[startIdx], i);
-    }    
+// Allocate a cache of nblocks entries. nblocks <= 0 disables caching.
+int cache_init(int nblocks) {
+    if (nblocks <= 0) {
+        cacheSize = 0;
+        return 0;
+    }
+    cacheEntries = (CacheEntry *)malloc(nblocks * sizeof(CacheEntry));
+    cacheHashSize = 1;
+    while (cacheHashSize < 2 * nblocks)
+        cacheHashSize <<= 1;
+    cacheHash = (CacheEntry **)calloc(cacheHashSize, sizeof(CacheEntry *));
+    if (cacheEntries == NULL || cacheHash == NULL) {
+        vs_log(LOG_ERROR, "Error in cache_init: Could not allocate %d cache blocks\n", nblocks);
+        free(cacheEntries);
+        free(cacheHash);
+        cacheEntries = NULL;
+        cacheHash = NULL;
+        cacheSize = 0;
+        return -1;
+    }
+    cacheSize = nblocks;
+    lruHead = lruTail = NULL;
+    for (int i = 0; i < nblocks; i++) {
+        cacheEntries[i].block = -1;
+        cacheEntries[i].dirty = 0;
+        cacheEntries[i].hashNext = NULL;
+        lru_push_front(&cacheEntries[i]);
+    }
+    return 0;
+}
 
+CacheEntry *cache_lookup(int k) {
+    CacheEntry *e = cacheHash[cache_hash(k)];
+    while (e != NULL && e->block != k)
+        e = e->hashNext;
+    return e;
+}
 
-    fsync (vs_fd); // synchronize kernel file cache with the disk
-    close (vs_fd);
-    return (0); 
+// Take the least recently used entry, writing it back if dirty,
+// and rebind it to block k. Returns NULL if the write-back fails; the
+// entry then keeps its dirty block for cache_flush to retry.
+static CacheEntry *cache_evict_for(int k) {
+    CacheEntry *e = lruTail;
+    if (e->block >= 0) {
+        if (e->dirty && disk_write_block(e->data, e->block) < 0)
+            return NULL;
+        cache_hash_remove(e);
+    }
+    e->block = k;
+    e->dirty = 0;
+    int h = cache_hash(k);
+    e->hashNext = cacheHash[h];
+    cacheHash[h] = e;
+    return e;
 }
 
-int vscreate(char *filename)
-{
-    // Search for an empty slot in the root directory
-    int emptySlot = -1;
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        if (rootDir[i].filename[0] == '\0') {
-            emptySlot = i;
-            break;
+// Write all dirty blocks back to the virtual disk.
+int cache_flush() {
+    int ret = 0;
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < cacheSize; i++) {
+        if (cacheEntries[i].block >= 0 && cacheEntries[i].dirty) {
+            if (disk_write_block(cacheEntries[i].data, cacheEntries[i].block) < 0)
+                ret = -1;
+            else
+                cacheEntries[i].dirty = 0;
         }
     }
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
 
-    // If there's no empty slot, return an error
-    if (emptySlot == -1) {
-        printf("Error in vscreate: No empty slots in the root directory");
-        return -1; // No available slot in the root directory
+// Drop block k from the cache without writing it back.
+void cache_discard(int k) {
+    if (cacheSize == 0)
+        return;
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry *e = cache_lookup(k);
+    if (e == NULL) {
+        pthread_mutex_unlock(&cacheLock);
+        return;
     }
+    cache_hash_remove(e);
+    e->block = -1;
+    e->dirty = 0;
+    lru_unlink(e);
+    // empty entries are reused first
+    e->prev = lruTail;
+    if (lruTail) lruTail->next = e; else lruHead = e;
+    lruTail = e;
+    pthread_mutex_unlock(&cacheLock);
+}
 
-    // Create a new directory entry for the file
-    DirectoryEntry newFile;
-    snprintf(newFile.filename, MAX_FILENAME_LENGTH, "%s", filename);
-    newFile.fileSize = 0;
+int cache_contains(int k) {
+    if (cacheSize == 0)
+        return 0;
+    pthread_mutex_lock(&cacheLock);
+    int found = cache_lookup(k) != NULL;
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
 
-    // Find the first available block in the FAT table
-    int startBlock = find_free_block();
-    if (startBlock == -1) {
-        printf("Error in vcreate: No free blocks available in the FAT table");
-        return -1;
+// Install a clean copy of block k unless the cache already holds it.
+// Called with cacheLock held.
+static void cache_fill(int k, void *data) {
+    CacheEntry *e = cache_lookup(k);
+    if (e == NULL) {
+        e = cache_evict_for(k);
+        if (e == NULL)
+            return; // the block stays uncached
+        memcpy(e->data, data, BLOCKSIZE);
     }
-    newFile.startBlock = startBlock;
-
-    // Insert the new directory entry into the root directory
-    rootDir[emptySlot] = newFile;
-    
-    return (0);
+    lru_unlink(e);
+    lru_push_front(e);
 }
 
+// Bring the given blocks into the cache ahead of use. Runs of
+// consecutive block numbers that are not cached yet are read from
+// disk with one read per run.
+void cache_prefetch(int *blocks, int count) {
+    if (cacheSize == 0 || count <= 0)
+        return;
+    char *run = (char *)malloc(count * BLOCKSIZE);
+    if (run == NULL)
+        return;
 
-int vsopen(char *filename, int mode)
-{
-    // Search for the file in the root directory
-    int fileIndex = -1;
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        if (strcmp(rootDir[i].filename, filename) == 0) {
-            fileIndex = i;
-            break;
-        }
-    }    
-
-    // If the file is not found, return an error
-    if (fileIndex == -1) {
-        printf("Error in vsopen: File not found\n");
-        return -1;
-    }
-
-    // Check if the file is already open in the specified mode
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        if (openFileTable[i].fd >= 0 && strcmp(openFileTable[i].filename, filename) == 0) {
-            if (openFileTable[i].mode == mode) {
-                printf("vsopen warning: File is already open in the specified mode.\nReturning existing file descriptor.\n");
-                return openFileTable[i].fd;
-            } else {
-                printf("vsopen warning: File is already open in a different mode.\nReturning existing file descriptor.\n");
-                return -1;
-            }
+    int i = 0;
+    while (i < count) {
+        pthread_mutex_lock(&cacheLock);
+        if (cache_lookup(blocks[i]) != NULL) {
+            pthread_mutex_unlock(&cacheLock);
+            i++;
+            continue;
         }
-    }
+        int runLength = 1;
+        while (i + runLength < count && blocks[i + runLength] == blocks[i] + runLength
+               && cache_lookup(blocks[i + runLength]) == NULL)
+            runLength++;
+        pthread_mutex_unlock(&cacheLock);
 
-    // Find an available entry in the open file table
-    int openFileIndex = -1;
-    for (int i = 0; i < ROOT_DIR_LENGTH; i++) {
-        if (openFileTable[i].fd == -1) {
-            openFileIndex = i;
-            break;
+        if (disk_read_blocks(run, blocks[i], runLength) == 0) {
+            pthread_mutex_lock(&cacheLock);
+            for (int j = 0; j < runLength; j++)
+                cache_fill(blocks[i + j], run + j * BLOCKSIZE);
+            pthread_mutex_unlock(&cacheLock);
         }
+        i += runLength;
     }
-    // If there's no available entry in the open file table, return an error
-    if (openFileIndex == -1) {
-        printf("Error in vsopen: Could not find available space for opening the file\n");
-        return -1;
-    }
-
-    // Initialize the open file table entry
-    snprintf(openFileTable[openFileIndex].filename, MAX_FILENAME_LENGTH, "%s", filename);
-    openFileTable[openFileIndex].mode = mode;
+    free(run);
+}
 
-    // Open the file based on the access mode
-    if (mode == MODE_READ) {
-        openFileTable[openFileIndex].fd = open(filename, O_RDONLY);
-    } else if (mode == MODE_APPEND) {
-        openFileTable[openFileIndex].fd = open(filename, O_APPEND);
-    } else {
-        printf("Error in vsopen: Invalid access mode\n");
-        return -1;
-    }
+/********************************************************************
+    Memory-mapped mode
 
-    // Return the index of the opened file in the openfile table
-    return openFileIndex;
+    With MOUNT_MMAP the whole virtual disk is mapped; FAT pages and
+    rootDir point into the mapping and data blocks are accessed in place.
+    Writes mark blocks in mapDirty and vssync msyncs those ranges.
+********************************************************************/
+// Address of block k inside the mapping, NULL when not mapped
+char *mapped_block(int k) {
+    if (vs_map == NULL)
+        return NULL;
+    return vs_map + (size_t) k * BLOCKSIZE;
 }
 
-// Returns 0 on success, -1 on failure
-int vsclose(int fd){
+// msync count blocks from block k; msync wants page-aligned ranges
+static int map_sync_range(int k, int count) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (size_t) k * BLOCKSIZE;
+    size_t end = start + (size_t) count * BLOCKSIZE;
+    start -= start % page;
+    if (end > vs_mapSize)
+        end = vs_mapSize;
+    STAT_ADD(syscalls, 1);
+    return msync(vs_map + start, end - start, MS_SYNC);
+}
 
-    if (checkFdValidity(fd) < 0){
-        printf("Error in vsclose: Either the file descriptor is invalid or the specified file is not open\n");
-        return -1;
+// msync every run of blocks written through the mapping
+int map_flush() {
+    int ret = 0;
+    int blocks = vs_mapSize / BLOCKSIZE;
+    int k = 0;
+    while (k < blocks) {
+        if (!mapDirty[k]) {
+            k++;
+            continue;
+        }
+        // Clear before syncing: a block written meanwhile stays dirty
+        int first = k;
+        while (k < blocks && __atomic_exchange_n(&mapDirty[k], 0, __ATOMIC_ACQ_REL))
+            k++;
+        if (map_sync_range(first, k - first) < 0) {
+            memset(&mapDirty[first], 1, k - first);
+            ret = -1;
+        }
     }
+    return ret;
+}
 
-    // Close the file using the file descriptor
-    int result = close(openFileTable[fd].fd);
-    if (result < 0){
-        printf("Error while closing file with fd %d", fd);
-        return -1;
+// Ask the kernel to fault in runs of consecutive blocks ahead of use
+void map_prefetch(int *blocks, int count) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    int i = 0;
+    while (i < count) {
+        int runLength = 1;
+        while (i + runLength < count && blocks[i + runLength] == blocks[i] + runLength)
+            runLength++;
+        size_t start = (size_t) blocks[i] * BLOCKSIZE;
+        size_t length = (size_t) runLength * BLOCKSIZE + start % page;
+        madvise(vs_map + start - start % page, length, MADV_WILLNEED);
+        STAT_ADD(syscalls, 1);
+        i += runLength;
     }
-    // Mark the open file table entry as free
-    openFileTable[fd].fd = -1;
-    openFileTable[fd].mode = -1; // Reset mode
+}
 
-    return 0;
+void cache_destroy() {
+    free(cacheEntries);
+    free(cacheHash);
+    cacheEntries = NULL;
+    cacheHash = NULL;
+    cacheSize = 0;
+    cacheHashSize = 0;
+    lruHead = lruTail = NULL;
 }
 
-int vssize (int  fd)
+// read block k through the block cache.
+int read_block (void *block, int k)
 {
-    if (checkFdValidity(fd) < 0){
-        printf("Error in vssize: Either the file descriptor is invalid or the specified file is not open\n");
-        return -1;
+    if (vs_map != NULL) {
+        memcpy(block, vs_map + (size_t) k * BLOCKSIZE, BLOCKSIZE);
+        return 0;
     }
+    if (cacheSize == 0)
+        return disk_read_block(block, k);
 
-    // Use the open file table to get the file size
-    return rootDir[find_file_by_name(openFileTable[fd].filename)].fileSize;
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry *e = cache_lookup(k);
+    if (e != NULL) {
+        lru_unlink(e);
+        lru_push_front(e);
+        memcpy(block, e->data, BLOCKSIZE);
+        pthread_mutex_unlock(&cacheLock);
+        STAT_ADD(cacheHits, 1);
+        return 0;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    STAT_ADD(cacheMisses, 1);
 
+    // Miss: read without holding the lock, then publish the block
+    if (disk_read_block(block, k) < 0)
+        return -1;
+    pthread_mutex_lock(&cacheLock);
+    cache_fill(k, block);
+    pthread_mutex_unlock(&cacheLock);
+    return (0); 
 }
 
-int vsread(int fd, void *buf, int n) {
-    // Check if the file descriptor is valid
-    if (checkFdValidity(fd) < 0) {
-        printf("Error in vsread: Either the file descriptor is invalid or the specified file is not open\n");
-        return -1;
+// write block k through the block cache; the disk copy is
+// updated when the block is evicted or the cache is flushed.
+int write_block (void *block, int k)
+{
+    if (vs_map != NULL) {
+        memcpy(vs_map + (size_t) k * BLOCKSIZE, block, BLOCKSIZE);
+        __atomic_store_n(&mapDirty[k], 1, __ATOMIC_RELEASE);
+        return 0;
     }
+    if (cacheSize == 0)
+        return disk_write_block(block, k);
 
-    // Get the file index in the root directory
-    int fileIndexInDirectory = find_file_by_name(openFileTable[fd].filename);
-
-    // Get the start block of the file
-    int currentBlock = rootDir[fileIndexInDirectory].startBlock;
-
-    // Initialize variables to keep track of the number of bytes read and the buffer offset
-    int bytesRead = 0;
-    int bufferOffset = 0;
+    pthread_mutex_lock(&cacheLock);
+    CacheEntry *e = cache_lookup(k);
+    if (e == NULL)
+        e = cache_evict_for(k);
+    if (e == NULL) {
+        // No entry could be freed; write this block through instead
+        pthread_mutex_unlock(&cacheLock);
+        return disk_write_block(block, k);
+    }
+    lru_unlink(e);
+    lru_push_front(e);
+    memcpy(e->data, block, BLOCKSIZE);
+    e->dirty = 1;
+    pthread_mutex_unlock(&cacheLock);
+    return 0; 
+}
 
-    // Continue reading until all requested bytes are read or we reach the end of the file
-    while (currentBlock != FAT_NO_NEXT && bytesRead < n) {
-        // Allocate a buffer to store the data block read from the virtual disk
-        char dataBlock[BLOCKSIZE];
+/********************************************************************
+    Paged metadata tables
 
-        // Read the data block from the virtual disk
-        read_block(dataBlock, currentBlock + METADATA_OFFSET);
+    A PagedTable is an on-disk array of ints, such as the FAT, that is
+    read one block-sized page at a time on first touch rather than all
+    at mount. Resident pages are kept in LRU order; once budget pages
+    are resident, the least recently used one is written back if dirty
+    and its memory reused. With pinDirty set, dirty pages stay resident
+    until table_flush, past the budget if need be, and pressure tells
+    the owner to flush. With MOUNT_MMAP pages are used in place in the
+    mapping and marked in mapDirty instead.
 
-        // Calculate the number of bytes to copy from the data block to the buffer
-        int bytesToCopy = (n - bytesRead) < BLOCKSIZE ? (n - bytesRead) : BLOCKSIZE;
+    t->lock guards the page array and the LRU list. Only journalLock
+    may be taken while it is held.
+********************************************************************/
+#define TABLE_ENTRIES_PER_PAGE (BLOCKSIZE / sizeof(int))
 
-        // Copy data from the data block to the buffer
-        memcpy(buf + bufferOffset, dataBlock, bytesToCopy);
+typedef struct TablePage {
+    int index; // page number within the table
+    int dirty; // 1 if data differs from the copy on disk
+    struct TablePage *prev; // LRU list, head is the most recently used
+    struct TablePage *next;
+    int data[TABLE_ENTRIES_PER_PAGE];
+} TablePage;
 
-        // Update counters
-        bytesRead += bytesToCopy;
-        bufferOffset += bytesToCopy;
+typedef struct {
+    int startBlock; // disk block holding page 0
+    int pageCount;
+    int budget; // resident pages allowed, 0 for no limit
+    int resident;
+    int pinDirty; // never write a page back on eviction
+    int pressure; // over budget with only dirty pages resident
+    TablePage **pages; // per page, NULL while it is not resident
+    TablePage *lruHead;
+    TablePage *lruTail;
+    pthread_mutex_t lock;
+} PagedTable;
 
-        // Move to the next block in the FAT table
-        currentBlock = fat[currentBlock].next;
+int table_init(PagedTable *t, int startBlock, int pageCount, int budget) {
+    t->startBlock = startBlock;
+    t->pageCount = pageCount;
+    t->budget = budget > 0 ? budget : 0;
+    t->resident = 0;
+    t->pinDirty = 0;
+    t->pressure = 0;
+    t->pages = NULL;
+    t->lruHead = NULL;
+    t->lruTail = NULL;
+    if (vs_map == NULL) {
+        t->pages = (TablePage **)calloc(pageCount, sizeof(TablePage *));
+        if (t->pages == NULL) {
+            vs_log(LOG_ERROR, "Error in vsmount: Could not allocate a page table of %d pages\n", pageCount);
+            t->pageCount = 0;
+            return -1;
+        }
     }
-
-    return bytesRead;
+    pthread_mutex_init(&t->lock, NULL);
+    return 0;
 }
 
-int vsappend(int fd, void *buf, int n) {
-    // Check if the file descriptor is valid
-    if (checkFdValidity(fd) < 0) {
-        printf("Error in vsappend: Either the file descriptor is invalid or the specified file is not open\n");
-        return -1;
-    }
-
-    // Get the file index in the root directory
-    int fileIndexInDirectory = find_file_by_name(openFileTable[fd].filename);
+static void table_unlink(PagedTable *t, TablePage *pg) {
+    if (pg->prev != NULL) pg->prev->next = pg->next; else t->lruHead = pg->next;
+    if (pg->next != NULL) pg->next->prev = pg->prev; else t->lruTail = pg->prev;
+    pg->prev = pg->next = NULL;
+}
 
-    // Get the start block of the file
-    int currentBlock = rootDir[fileIndexInDirectory].startBlock;
+static void table_push_front(PagedTable *t, TablePage *pg) {
+    pg->prev = NULL;
+    pg->next = t->lruHead;
+    if (t->lruHead != NULL) t->lruHead->prev = pg;
+    t->lruHead = pg;
+    if (t->lruTail == NULL) t->lruTail = pg;
+}
 
-    // Move to the end of the file
-    while (fat[currentBlock].next != FAT_NO_NEXT) {
-        currentBlock = fat[currentBlock].next;
+// Drop the least recently used page that can be dropped, writing it
+// back first if dirty. Returns it for reuse, or NULL if none could be.
+static TablePage *table_evict(PagedTable *t) {
+    for (TablePage *pg = t->lruTail; pg != NULL; pg = pg->prev) {
+        if (pg->dirty && (t->pinDirty || disk_write_block(pg->data, t->startBlock + pg->index) < 0))
+            continue;
+        table_unlink(t, pg);
+        t->pages[pg->index] = NULL;
+        t->resident--;
+        return pg;
     }
+    return NULL;
+}
 
-    // Calculate the offset within the last block
-    int offsetWithinBlock = rootDir[fileIndexInDirectory].fileSize % BLOCKSIZE;
+// Entries of page p, read from disk on first touch. Called with
+// t->lock held; returns NULL if the page cannot be read.
+static int *table_page(PagedTable *t, int p) {
+    if (vs_map != NULL)
+        return (int *) mapped_block(t->startBlock + p);
 
-    // Append new data blocks to the file
-    int bytesRead = 0;
-    while (bytesRead < n) {
-        // Check if there's space in the current block
-        int spaceInBlock = BLOCKSIZE - offsetWithinBlock;
-        int bytesToWrite = (n - bytesRead) < spaceInBlock ? (n - bytesRead) : spaceInBlock;
+    TablePage *pg = t->pages[p];
+    if (pg != NULL) {
+        if (pg != t->lruHead) {
+            table_unlink(t, pg);
+            table_push_front(t, pg);
+        }
+        return pg->data;
+    }
 
-        // Write the data block to the virtual disk
-        write_block(buf + bytesRead, currentBlock + METADATA_OFFSET);
+    if (t->budget > 0 && t->resident >= t->budget) {
+        pg = table_evict(t);
+        if (pg == NULL && t->pinDirty)
+            __atomic_store_n(&t->pressure, 1, __ATOMIC_RELAXED);
+    }
+    if (pg == NULL)
+        pg = (TablePage *)malloc(sizeof(TablePage));
+    if (pg == NULL || disk_read_block(pg->data, t->startBlock + p) < 0) {
+        free(pg);
+        return NULL;
+    }
+    pg->index = p;
+    pg->dirty = 0;
+    t->pages[p] = pg;
+    t->resident++;
+    table_push_front(t, pg);
+    return pg->data;
+}
 
-        // Update counters
-        bytesRead += bytesToWrite;
-        rootDir[fileIndexInDirectory].fileSize += bytesToWrite;
+// Read entry i into *value. Returns 0 on success, -1 on a read error.
+int table_get(PagedTable *t, int i, int *value) {
+    pthread_mutex_lock(&t->lock);
+    int *data = table_page(t, i / TABLE_ENTRIES_PER_PAGE);
+    if (data != NULL)
+        *value = data[i % TABLE_ENTRIES_PER_PAGE];
+    pthread_mutex_unlock(&t->lock);
+    return data != NULL ? 0 : -1;
+}
 
-        // Check if we need to allocate a new block
-        if (bytesRead < n) {
-            // Find a free block in the FAT table
-            int newBlock = find_free_block();
+// Mark resident page p changed. Called with t->lock held.
+static void table_dirty(PagedTable *t, int p) {
+    if (vs_map != NULL)
+        __atomic_store_n(&mapDirty[t->startBlock + p], 1, __ATOMIC_RELEASE);
+    else
+        t->pages[p]->dirty = 1;
+}
 
-            // Update the FAT table entry for the new block
-            fat[currentBlock].next = newBlock;
-            fat[newBlock].next = FAT_NO_NEXT;
+// Set entry i. The page reaches the disk when it is evicted or flushed.
+int table_set(PagedTable *t, int i, int value) {
+    int p = i / TABLE_ENTRIES_PER_PAGE;
+    pthread_mutex_lock(&t->lock);
+    int *data = table_page(t, p);
+    if (data != NULL) {
+        data[i % TABLE_ENTRIES_PER_PAGE] = value;
+        table_dirty(t, p);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return data != NULL ? 0 : -1;
+}
 
-            // Move to the new block
-            currentBlock = newBlock;
-            offsetWithinBlock = 0;
+// Write back every dirty resident page, one pwritev per run of
+// consecutive pages. With MOUNT_MMAP map_flush does this instead.
+int table_flush(PagedTable *t) {
+    if (vs_map != NULL)
+        return 0;
+    struct iovec iov[MAX_IO_SLICES];
+    TablePage *run[MAX_IO_SLICES];
+    int ret = 0;
+    pthread_mutex_lock(&t->lock);
+    int p = 0;
+    while (p < t->pageCount) {
+        if (t->pages[p] == NULL || !t->pages[p]->dirty) {
+            p++;
+            continue;
+        }
+        int first = p;
+        int count = 0;
+        while (p < t->pageCount && count < MAX_IO_SLICES
+               && t->pages[p] != NULL && t->pages[p]->dirty) {
+            run[count] = t->pages[p];
+            iov[count].iov_base = run[count]->data;
+            iov[count].iov_len = BLOCKSIZE;
+            count++;
+            p++;
+        }
+        off_t offset = (off_t) (t->startBlock + first) * BLOCKSIZE;
+        STAT_ADD(blockWrites, count);
+        STAT_ADD(syscalls, 1);
+        if (pwritev(vs_fd, iov, count, offset) != (ssize_t) count * BLOCKSIZE) {
+            vs_log(LOG_ERROR, "write error\n");
+            ret = -1;
+            continue;
         }
+        for (int j = 0; j < count; j++)
+            run[j]->dirty = 0;
     }
+    if (ret == 0)
+        __atomic_store_n(&t->pressure, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
 
-    return bytesRead;
+// Free the resident pages; flush first to keep changes. Does nothing
+// to a table that is not set up.
+void table_destroy(PagedTable *t) {
+    if (t->pageCount == 0)
+        return;
+    TablePage *pg = t->lruHead;
+    while (pg != NULL) {
+        TablePage *next = pg->next;
+        free(pg);
+        pg = next;
+    }
+    free(t->pages);
+    t->pages = NULL;
+    t->lruHead = NULL;
+    t->lruTail = NULL;
+    t->resident = 0;
+    t->pageCount = 0;
+    pthread_mutex_destroy(&t->lock);
 }
 
-int vsdelete(char *filename)
-{
-    // Search for the file in the root directory
-    int fileIndex = find_file_by_name(filename);
+/********************************************************************
+    Scatter/gather
 
-    // If the file is not found, return an error
-    if (fileIndex == -1) {
-        printf("Error in vsdelete: File not found\n");
-        return -1;
-    }
+    vsreadv and vsappendv move data between the caller's iovecs and
+    the disk. Whole blocks on consecutive disk blocks are transferred
+    with one preadv/pwritev whose iovecs point into the caller's
+    buffers; partial blocks go through read_block/write_block.
+********************************************************************/
+typedef struct {
+    const struct iovec *iov;
+    int iovcnt;
+    int index; // iovec holding the next byte
+    size_t offset; // bytes of iov[index] already consumed
+} IovCursor;
 
-    // Free the blocks in the FAT table and the data table 
-    int currentBlock = rootDir[fileIndex].startBlock;
-    while (currentBlock != FAT_NO_NEXT) {
-        // write the deleted data block back to the virtual disk
-        write_block(NULL, currentBlock + METADATA_OFFSET); 
+static void iov_init(IovCursor *c, const struct iovec *iov, int iovcnt) {
+    c->iov = iov;
+    c->iovcnt = iovcnt;
+    c->index = 0;
+    c->offset = 0;
+}
 
-        int nextBlock = fat[currentBlock].next;
-        fat[currentBlock].next = FAT_UNALLOCATED; // Mark block as unallocated
-        currentBlock = nextBlock;
+// Total length of the iovecs, clamped to what an int result can hold
+static int iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+        if (total > INT_MAX)
+            return INT_MAX;
     }
+    return (int) total;
+}
 
-    // Clear the directory entry for the file
-    strcpy(rootDir[fileIndex].filename, "\0");
-    rootDir[fileIndex].fileSize = 0;
-    rootDir[fileIndex].startBlock = FAT_UNALLOCATED;
+// Consume n bytes from the iovecs, copying them to dst (gather) or
+// filling them from src (scatter).
+static void iov_copy(IovCursor *c, char *dst, const char *src, size_t n) {
+    while (n > 0 && c->index < c->iovcnt) {
+        size_t avail = c->iov[c->index].iov_len - c->offset;
+        size_t chunk = n < avail ? n : avail;
+        char *base = (char *) c->iov[c->index].iov_base + c->offset;
+        if (dst != NULL) {
+            memcpy(dst, base, chunk);
+            dst += chunk;
+        } else {
+            memcpy(base, src, chunk);
+            src += chunk;
+        }
+        n -= chunk;
+        c->offset += chunk;
+        if (c->offset == c->iov[c->index].iov_len) {
+            c->index++;
+            c->offset = 0;
+        }
+    }
+}
 
-    return 0;
+static void iov_gather(IovCursor *c, char *dst, size_t n) {
+    iov_copy(c, dst, NULL, n);
 }
 
+static void iov_scatter(IovCursor *c, const char *src, size_t n) {
+    iov_copy(c, NULL, src, n);
+}
+
+// Describe up to n of the next bytes as at most max iovecs pointing
+// into the caller's buffers, and consume them. Returns the byte count.
+static size_t iov_slice(IovCursor *c, size_t n, struct iovec *out, int max, int *count) {
+    size_t covered = 0;
+    *count = 0;
+    while (covered < n && *count < max && c->index < c->iovcnt) {
+        size_t avail = c->iov[c->index].iov_len - c->offset;
+        size_t chunk = (n - covered) < avail ? (n - covered) : avail;
+        if (chunk > 0) {
+            out[*count].iov_base = (char *) c->iov[c->index].iov_base + c->offset;
+            out[*count].iov_len = chunk;
+            (*count)++;
+            covered += chunk;
+            c->offset += chunk;
+        }
+        if (c->offset == c->iov[c->index].iov_len) {
+            c->index++;
+            c->offset = 0;
+        }
+    }
+    return covered;
+}
+
+// Transfer n bytes between the iovecs and the disk starting at block
+// k. Each call moves as much as MAX_IO_SLICES iovecs can describe.
+static int disk_transfer_v(IovCursor *c, int k, size_t n, int write) {
+    struct iovec slices[MAX_IO_SLICES];
+    off_t offset = (off_t) k * BLOCKSIZE;
+    while (n > 0) {
+        int count;
+        size_t covered = iov_slice(c, n, slices, MAX_IO_SLICES, &count);
+        if (covered == 0)
+            return -1;
+        ssize_t done = write ? pwritev(vs_fd, slices, count, offset)
+                             : preadv(vs_fd, slices, count, offset);
+        STAT_ADD(syscalls, 1);
+        if (write)
+            STAT_ADD(blockWrites, covered / BLOCKSIZE);
+        else
+            STAT_ADD(blockReads, covered / BLOCKSIZE);
+        if (done != (ssize_t) covered) {
+            vs_log(LOG_ERROR, write ? "write error\n" : "read error\n");
+            return -1;
+        }
+        offset += covered;
+        n -= covered;
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////
+
+typedef struct {
+    int blockSize;
+    int fatSize; // FAT blocks
+    int rootDirSize; // root directory blocks
+    int diskSize; // bytes, saturated at INT_MAX; see diskBytes
+
+    // Layout, valid when magic == VSFS_MAGIC
+    int magic;
+    int version;
+    int64_t diskBytes;
+    int fatStart; // first FAT block
+    int rootDirStart; // first root directory block
+    int rootDirLength; // directory entries
+    int dataStart; // disk block of data block 0
+    int dataBlocks; // data blocks, one FAT entry each
+    int flags; // FORMAT_EXTENTS, FORMAT_CHECKSUMS
+    int dirExtBlock; // first directory extension block, chained by the FAT
+    int dirExtBlocks; // directory extension blocks, 0 if there are none
+    int journalStart; // first block of the metadata journal
+    int journalBlocks; // 0 if the disk has no journal
+    int refStart; // first block of the reference count table
+    int refBlocks; // 0 if the disk has none (before version 6, or without extents)
+    int sharedBlocks; // data blocks with more than one owner
+    int sumStart; // first block of the checksum table
+    int sumBlocks; // 0 if the disk has none (before version 7, or without FORMAT_CHECKSUMS)
+
+    // Padding to make the structure exactly one block
+    char padding[1956];
+} SuperBlock;
+
+// A run of length consecutive data blocks starting at start
+typedef struct {
+    int start;
+    int length;
+} Extent;
+
+#define INLINE_EXTENTS 10 // extents kept in the directory entry itself
+#define INLINE_DATA_SIZE (INLINE_EXTENTS * sizeof(Extent)) // bytes of a small file kept in its entry
+
+typedef struct {
+    char filename[MAX_FILENAME_LENGTH];
+    int fileSize;
+    int startBlock; // FAT_INLINE while the contents are in inlineData
+
+    // Extent mode only: the file's blocks as runs, in file order. The
+    // first INLINE_EXTENTS are here, the rest in a chain of extent
+    // blocks starting at extentBlock. Together these make the
+    // structure 128 bytes.
+    int extentCount;
+    int extentBlock; // FAT_NO_NEXT when every extent is inline
+    union {
+        Extent extents[INLINE_EXTENTS];
+        char inlineData[INLINE_DATA_SIZE]; // contents of a file with no data block
+    };
+} DirectoryEntry;
+
+// Overflow extents of one file, stored in a data block
+#define EXTENTS_PER_BLOCK (BLOCKSIZE / sizeof(Extent) - 1)
+
+typedef struct {
+    int next; // next extent block, FAT_NO_NEXT at the end of the chain
+    int count; // extents used in this block
+    Extent extents[EXTENTS_PER_BLOCK];
+} ExtentBlock;
+
+#define FAT_UNALLOCATED -1 // fat entry is unallocated
+#define FAT_NO_NEXT -2 // fat entry is allocated but has no next entry (tail of the list)
+#define FAT_INLINE -3 // startBlock of a file whose contents are in its directory entry
+
+typedef struct {
+    int next; // Pointer to the next cluster
+    // next = FAT_UNALLOCATED for unallocated
+    // next = FAT_NO_NEXT for allocated but next cluster is empty
+} FatEntry;
+
+SuperBlock superblock;
+DirectoryEntry *rootDir;
+
+// Layout of the volume being formatted or mounted, from the superblock.
+// Data block b (the FAT index) is disk block dataStart + b.
+int fatStart;
+int fatBlocks;
+int rootDirStart;
+int rootDirBlocks;
+int rootDirLength;
+int dataStart;
+int dataBlocks;
+int journalStart;
+int journalBlocks; // 0 without a journal
+int refStart;
+int refBlocks; // 0 without a reference count table
+int sumStart;
+int sumBlocks; // 0 without a checksum table
+int extentMode; // files are mapped by extents; the FAT only marks allocation
+
+// The directory is the root directory blocks followed by extension
+// blocks, data blocks chained through the FAT and added as the root
+// directory fills up. Slot s is entry s % DIR_ENTRIES_PER_BLOCK of
+// dirBlocks[s / DIR_ENTRIES_PER_BLOCK]. dirBlocks is allocated at its
+// full capacity by vsmount, so entries never move as it grows.
+DirectoryEntry **dirBlocks = NULL;
+int dirBlockCount = 0;
+int dirBlockCapacity = 0;
+int dirLength = 0; // slots, dirBlockCount * DIR_ENTRIES_PER_BLOCK
+int *dirExtBlockNo = NULL; // data block of each extension block
+char *dirExtDirty = NULL; // per extension block, buffered mode only
+
+static inline DirectoryEntry *dir_entry(int slot) {
+    return &dirBlocks[slot / DIR_ENTRIES_PER_BLOCK][slot % DIR_ENTRIES_PER_BLOCK];
+}
+
+// Choose the layout for a new disk of diskBytes bytes: superblock, then
+// a FAT with one entry per data block, then with FORMAT_EXTENTS a
+// reference count table of the same size, then with FORMAT_CHECKSUMS a
+// checksum table of the same size, then the root directory, then the
+// journal, then data. Returns -1 if the disk is too small or
+// too large.
+static int layout_for_disk(int64_t diskBytes, int flags) {
+    int64_t totalBlocks = diskBytes / BLOCKSIZE;
+    if (totalBlocks > INT_MAX)
+        return -1;
+
+    int64_t entries = totalBlocks / BLOCKS_PER_DIR_ENTRY;
+    if (entries < MIN_ROOT_DIR_LENGTH)
+        entries = MIN_ROOT_DIR_LENGTH;
+    if (entries > MAX_ROOT_DIR_LENGTH)
+        entries = MAX_ROOT_DIR_LENGTH;
+    rootDirLength = (int) entries;
+    rootDirBlocks = rootDirLength / DIR_ENTRIES_PER_BLOCK;
+
+    int64_t journal = totalBlocks / 1024;
+    if (journal < JOURNAL_MIN_BLOCKS)
+        journal = JOURNAL_MIN_BLOCKS;
+    if (journal > JOURNAL_MAX_BLOCKS)
+        journal = JOURNAL_MAX_BLOCKS;
+    journalBlocks = (int) journal;
+
+    // Each FAT block, and each reference count or checksum block, maps
+    // FAT_ENTRIES_PER_BLOCK data blocks
+    int tables = 1 + (flags & FORMAT_EXTENTS ? 1 : 0) + (flags & FORMAT_CHECKSUMS ? 1 : 0);
+    int64_t remaining = totalBlocks - SUPERBLOCK_SIZE_IN_BLOCKS - rootDirBlocks - journalBlocks;
+    fatBlocks = (int) ((remaining + FAT_ENTRIES_PER_BLOCK + tables - 1) / (FAT_ENTRIES_PER_BLOCK + tables));
+    refBlocks = flags & FORMAT_EXTENTS ? fatBlocks : 0;
+    sumBlocks = flags & FORMAT_CHECKSUMS ? fatBlocks : 0;
+    dataBlocks = (int) (remaining - fatBlocks - refBlocks - sumBlocks);
+    if (dataBlocks <= 0)
+        return -1;
+
+    fatStart = SUPERBLOCK_SIZE_IN_BLOCKS;
+    refStart = fatStart + fatBlocks;
+    sumStart = refStart + refBlocks;
+    rootDirStart = sumStart + sumBlocks;
+    journalStart = rootDirStart + rootDirBlocks;
+    dataStart = journalStart + journalBlocks;
+    return 0;
+}
+
+// Take the layout from the superblock in memory
+static int layout_from_superblock() {
+    if (superblock.blockSize != BLOCKSIZE) {
+        vs_log(LOG_ERROR, "Error in vsmount: Block size %d is not %d\n", superblock.blockSize, BLOCKSIZE);
+        return -1;
+    }
+    if (superblock.magic == VSFS_MAGIC) {
+        fatStart = superblock.fatStart;
+        fatBlocks = superblock.fatSize;
+        rootDirStart = superblock.rootDirStart;
+        rootDirBlocks = superblock.rootDirSize;
+        rootDirLength = superblock.rootDirLength;
+        dataStart = superblock.dataStart;
+        dataBlocks = superblock.dataBlocks;
+        journalStart = superblock.journalStart;
+        journalBlocks = superblock.journalBlocks; // 0 before version 5
+        if (journalBlocks < 0 || (journalBlocks > 0
+            && (journalBlocks < 2 || journalStart < rootDirStart + rootDirBlocks
+                || journalStart + journalBlocks > dataStart))) {
+            vs_log(LOG_ERROR, "Error in vsmount: Superblock describes an invalid journal\n");
+            return -1;
+        }
+        refStart = superblock.refStart;
+        refBlocks = superblock.refBlocks; // 0 before version 6
+        if (refBlocks < 0 || (refBlocks > 0
+            && ((int64_t) refBlocks * FAT_ENTRIES_PER_BLOCK < superblock.dataBlocks
+                || refStart < fatStart + fatBlocks || refStart + refBlocks > rootDirStart))) {
+            vs_log(LOG_ERROR, "Error in vsmount: Superblock describes an invalid reference count table\n");
+            return -1;
+        }
+        sumStart = superblock.sumStart;
+        sumBlocks = superblock.sumBlocks; // 0 before version 7
+        if (sumBlocks < 0 || (sumBlocks > 0
+            && ((int64_t) sumBlocks * FAT_ENTRIES_PER_BLOCK < superblock.dataBlocks
+                || sumStart < fatStart + fatBlocks || sumStart + sumBlocks > rootDirStart))) {
+            vs_log(LOG_ERROR, "Error in vsmount: Superblock describes an invalid checksum table\n");
+            return -1;
+        }
+        if (superblock.flags & ~(FORMAT_EXTENTS | FORMAT_CHECKSUMS)) {
+            vs_log(LOG_ERROR, "Error in vsmount: Unknown format flags %x\n", superblock.flags);
+            return -1;
+        }
+        extentMode = (superblock.flags & FORMAT_EXTENTS) != 0;
+        if (superblock.version > VSFS_VERSION) {
+            vs_log(LOG_ERROR, "Error in vsmount: Disk version %d is newer than %d\n", superblock.version, VSFS_VERSION);
+            return -1;
+        }
+    } else {
+        extentMode = 0;
+        journalBlocks = 0;
+        refBlocks = 0;
+        sumBlocks = 0;
+        fatStart = SUPERBLOCK_SIZE_IN_BLOCKS;
+        fatBlocks = LEGACY_FAT_SIZE_IN_BLOCKS;
+        rootDirStart = fatStart + fatBlocks;
+        rootDirBlocks = LEGACY_ROOT_DIR_SIZE_IN_BLOCKS;
+        rootDirLength = rootDirBlocks * DIR_ENTRIES_PER_BLOCK;
+        dataStart = LEGACY_METADATA_OFFSET;
+        dataBlocks = superblock.diskSize / BLOCKSIZE - dataStart;
+        if (dataBlocks > LEGACY_FAT_TABLE_LENGTH)
+            dataBlocks = LEGACY_FAT_TABLE_LENGTH;
+    }
+    if (dataBlocks <= 0 || (int64_t) fatBlocks * FAT_ENTRIES_PER_BLOCK < dataBlocks) {
+        vs_log(LOG_ERROR, "Error in vsmount: Superblock describes an invalid layout\n");
+        return -1;
+    }
+    return 0;
+}
+
+// In-memory copy of a file's extents (extent mode)
+typedef struct {
+    Extent *extents;
+    int count;
+    int capacity;
+    int blocks; // sum of the extent lengths
+    int *chain; // extent blocks holding extents past INLINE_EXTENTS
+    int chainCount;
+    int hint; // extent the last lookup ended in, a guess for the next one
+} ExtentMap;
+
+typedef struct {
+    int fd; // File descriptor returned by vsopen, -1 if the entry is free
+    int nextFree; // next entry of the free list while fd is -1
+    char filename[MAX_FILENAME_LENGTH];
+    int mode; // MODE_READ or MODE_APPEND
+    int dirIndex; // index of the file's entry in rootDir
+
+    // Append position, resolved once by vsopen and kept up to date by
+    // vsappend so that appends never walk the FAT chain.
+    int tailBlock; // last block of the file's chain
+    int tailOffset; // bytes used in tailBlock, BLOCKSIZE when it is full
+
+    // Read position, so that consecutive vsread calls continue where
+    // the previous one stopped.
+    int readOffset; // file offset of the next byte to read
+    int readBlock; // block holding readOffset, FAT_NO_NEXT past the chain
+    int readaheadEnd; // blocks of the file below this index are prefetched
+
+    // Skip index for random access: skipIndex[i] is the file's block
+    // number i * SKIP_INTERVAL. Filled in as the chain is walked and
+    // reset by appends.
+    int *skipIndex;
+    int skipCount; // valid entries
+    int skipCapacity;
+
+    // Extent mode: the file's extents, loaded by vsopen
+    ExtentMap extentMap;
+
+    // Tail buffer: appends smaller than a block are collected here and
+    // the tail block is written when it fills, when the flush policy
+    // says so, or on vsclose and vssync. Reads through this descriptor
+    // see the buffer instead of the stale block.
+    char tailBuf[BLOCKSIZE];
+    int tailLoaded; // tailBuf holds the tail block's first tailOffset bytes
+    int tailPending; // bytes appended to tailBuf but not yet written
+    int tailAppends; // appends since the tail block was last written
+    long tailSince; // now_ms() of the first of those appends
+
+    // Asynchronous requests on this descriptor, guarded by asyncLock
+    int asyncPending; // submitted, not completed
+    int asyncNextTicket;
+    int asyncServing; // ticket of the append allowed to run
+
+    // Appends and vsclose hold lock for writing, reads for reading.
+    // cursorLock serializes updates to the read position and the
+    // skip index.
+    pthread_rwlock_t lock;
+    pthread_mutex_t cursorLock;
+} OpenFileEntry;
+
+int readaheadBlocks = DEFAULT_READAHEAD_BLOCKS;
+int tailFlushBytes = DEFAULT_TAIL_FLUSH_BYTES;
+int tailFlushCount = DEFAULT_TAIL_FLUSH_COUNT;
+int tailFlushMs = DEFAULT_TAIL_FLUSH_MS;
+
+// Asynchronous I/O, at the end of this file
+void async_drain(int fd);
+void async_shutdown();
+
+// Metadata journal, before the application functions
+int journalActive = 0; // mounted with a journal; metadata changes are logged
+int journalPressure = 0; // a checkpoint is due: the journal or a buffer of held metadata is full
+int journalOverflow = 0; // records were dropped; the next checkpoint must stage the metadata
+void journal_log(int block, int offset, const void *data, int length);
+
+// Open file table, in chunks of FD_CHUNK entries that are allocated as
+// needed and never move, so a descriptor stays valid while the table
+// grows. Free entries are linked from fdFreeHead through nextFree.
+OpenFileEntry *openFileChunks[MAX_OPEN_FILES / FD_CHUNK];
+int openFileCount = 0; // entries allocated
+int fdFreeHead = -1;
+int *dirOpenFd = NULL; // per directory slot, the descriptor open on it or -1
+
+static inline OpenFileEntry *fd_entry(int fd) {
+    return &openFileChunks[fd / FD_CHUNK][fd % FD_CHUNK];
+}
+
+// Lock order: dirLock, then an open file's lock, then allocLock, then
+// cacheLock. dirLock guards rootDir slots, the name index and the open
+// file table; allocLock guards the free-space bitmap.
+pthread_rwlock_t dirLock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+
+// typedef struct {
+//     char* data;
+// } DataBlock;
+// DataBlock *dataBlocks;
+
+/********************************************************************
+    Helper functions, not called directly by applications
+********************************************************************/
+// Metadata blocks (superblock, root directory) changed since they were
+// last written, indexed by disk block number below dataStart. The FAT
+// is paged in by fatTable and tracks its own dirty blocks.
+char *metaDirty = NULL;
+
+PagedTable fatTable;
+
+// Next block of the chain after block i. A FAT block that cannot be
+// read ends the chain rather than sending it to an arbitrary block.
+int fat_get(int i) {
+    int next;
+    STAT_ADD(fatHops, 1);
+    if (table_get(&fatTable, i, &next) < 0)
+        return FAT_NO_NEXT;
+    return next;
+}
+
+void fat_set(int i, int next) {
+    table_set(&fatTable, i, next);
+    journal_log(fatStart + i / FAT_ENTRIES_PER_BLOCK, (i % FAT_ENTRIES_PER_BLOCK) * sizeof(FatEntry),
+                &next, sizeof(int));
+}
+
+// Extent mode: for each data block, the number of files sharing it
+// beyond the first, so 0 for a block of one file. vsclone raises the
+// counts of the blocks it shares; superblock.sharedBlocks counts the
+// blocks above 0, and while it is 0 nothing needs to look here.
+PagedTable refTable;
+
+static int blocks_shared() {
+    return __atomic_load_n(&superblock.sharedBlocks, __ATOMIC_RELAXED) > 0;
+}
+
+// Share count of data block b, or -1 if the table cannot be read
+static int ref_count(int b) {
+    int count;
+    return table_get(&refTable, b, &count) < 0 ? -1 : count;
+}
+
+// Add delta to the share count of data block b, unless that would
+// take it below 0. Returns the count before, or -1 if the table cannot
+// be read.
+static int ref_add(int b, int delta) {
+    int p = b / TABLE_ENTRIES_PER_PAGE;
+    pthread_mutex_lock(&refTable.lock);
+    int *data = table_page(&refTable, p);
+    if (data == NULL) {
+        pthread_mutex_unlock(&refTable.lock);
+        return -1;
+    }
+    int *count = &data[b % TABLE_ENTRIES_PER_PAGE];
+    int old = *count;
+    if (old + delta >= 0) {
+        *count = old + delta;
+        table_dirty(&refTable, p);
+        journal_log(refStart + p, (b % TABLE_ENTRIES_PER_PAGE) * sizeof(int), count, sizeof(int));
+        if ((old == 0) != (*count == 0)) {
+            __atomic_store_n(&superblock.sharedBlocks, superblock.sharedBlocks + (old == 0 ? 1 : -1),
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&metaDirty[0], 1, __ATOMIC_RELEASE);
+            journal_log(0, offsetof(SuperBlock, sharedBlocks), &superblock.sharedBlocks, sizeof(int));
+        }
+    }
+    pthread_mutex_unlock(&refTable.lock);
+    return old;
+}
+
+// FORMAT_CHECKSUMS: for each data block, the CRC-32C of the bytes its
+// file has in it. Files only grow, so an append extends the checksum of
+// its tail block from the new bytes alone, and the checksum commits
+// with the fileSize that covers it. vsfsck checks blocks against it.
+PagedTable sumTable;
+
+unsigned int crc32c_extend(unsigned int crc, const void *data, size_t n);
+
+void sum_set(int b, unsigned int sum) {
+    table_set(&sumTable, b, (int) sum);
+    journal_log(sumStart + b / TABLE_ENTRIES_PER_PAGE, (b % TABLE_ENTRIES_PER_PAGE) * sizeof(int),
+                &sum, sizeof(int));
+}
+
+// Record that n bytes were put at offset of data block b, which holds
+// nothing of the file past them. Called with the file's lock held.
+static void sum_append(int b, int offset, const void *bytes, int n) {
+    if (sumBlocks == 0)
+        return;
+    int p = b / TABLE_ENTRIES_PER_PAGE;
+    pthread_mutex_lock(&sumTable.lock);
+    int *data = table_page(&sumTable, p);
+    if (data != NULL) {
+        unsigned int *sum = (unsigned int *) &data[b % TABLE_ENTRIES_PER_PAGE];
+        *sum = crc32c_extend(offset > 0 ? *sum : 0, bytes, n);
+        table_dirty(&sumTable, p);
+        journal_log(sumStart + p, (b % TABLE_ENTRIES_PER_PAGE) * sizeof(int), sum, sizeof(int));
+    }
+    pthread_mutex_unlock(&sumTable.lock);
+}
+
+// Data block to now holds a copy of the file bytes in data block from
+static void sum_copy(int from, int to) {
+    int sum;
+    if (sumBlocks > 0 && table_get(&sumTable, from, &sum) == 0)
+        sum_set(to, (unsigned int) sum);
+}
+
+// Record the checksums of count whole blocks from data block b on,
+// about to be written from c
+static void sum_iov_blocks(IovCursor c, int b, int count) {
+    if (sumBlocks == 0)
+        return;
+    for (int i = 0; i < count; i++) {
+        unsigned int crc = 0;
+        for (size_t n = BLOCKSIZE; n > 0 && c.index < c.iovcnt; ) {
+            size_t avail = c.iov[c.index].iov_len - c.offset;
+            size_t chunk = n < avail ? n : avail;
+            crc = crc32c_extend(crc, (const char *) c.iov[c.index].iov_base + c.offset, chunk);
+            n -= chunk;
+            c.offset += chunk;
+            if (c.offset == c.iov[c.index].iov_len) {
+                c.index++;
+                c.offset = 0;
+            }
+        }
+        sum_set(b + i, crc);
+    }
+}
+
+// Call after changing the directory entry in slot
+void dir_mark_dirty(int slot) {
+    int k = slot / DIR_ENTRIES_PER_BLOCK;
+    int diskBlock;
+    if (k < rootDirBlocks) {
+        diskBlock = rootDirStart + k;
+        __atomic_store_n(&metaDirty[diskBlock], 1, __ATOMIC_RELEASE);
+    } else {
+        diskBlock = dirExtBlockNo[k - rootDirBlocks] + dataStart;
+        if (vs_map != NULL)
+            __atomic_store_n(&mapDirty[diskBlock], 1, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n(&dirExtDirty[k - rootDirBlocks], 1, __ATOMIC_RELEASE);
+    }
+    journal_log(diskBlock, (slot % DIR_ENTRIES_PER_BLOCK) * sizeof(DirectoryEntry),
+                dir_entry(slot), sizeof(DirectoryEntry));
+}
+
+// In-memory copy of metadata block k
+static void *metadata_block(int k) {
+    if (k < fatStart)
+        return &superblock;
+    return &rootDir[(size_t) (k - rootDirStart) * DIR_ENTRIES_PER_BLOCK];
+}
+
+// Write the dirty metadata blocks, one pwritev per run of consecutive
+// dirty blocks. Flags are cleared before the write, so a change made
+// while it is in progress is written by the next flush.
+int flush_metadata() {
+    struct iovec iov[MAX_IO_SLICES];
+    int ret = 0;
+    int k = 0;
+    while (k < dataStart) {
+        if (!metaDirty[k]) {
+            k++;
+            continue;
+        }
+        int first = k;
+        int count = 0;
+        while (k < dataStart && count < MAX_IO_SLICES
+               && __atomic_exchange_n(&metaDirty[k], 0, __ATOMIC_ACQ_REL)) {
+            iov[count].iov_base = metadata_block(k);
+            iov[count].iov_len = BLOCKSIZE;
+            count++;
+            k++;
+        }
+        if (vs_map != NULL) {
+            // rootDir lives in the mapping; the superblock is a copy
+            if (first == 0)
+                memcpy(vs_map, &superblock, BLOCKSIZE);
+            if (map_sync_range(first, count) < 0) {
+                memset(&metaDirty[first], 1, count);
+                ret = -1;
+            }
+        } else {
+            STAT_ADD(blockWrites, count);
+            STAT_ADD(syscalls, 1);
+            if (pwritev(vs_fd, iov, count, (off_t) first * BLOCKSIZE) != (ssize_t) count * BLOCKSIZE) {
+                vs_log(LOG_ERROR, "write error\n");
+                memset(&metaDirty[first], 1, count);
+                ret = -1;
+            }
+        }
+    }
+
+    // Directory extension blocks; a mapped disk syncs them with the data
+    for (int i = 0; vs_map == NULL && i < dirBlockCount - rootDirBlocks; i++) {
+        if (__atomic_exchange_n(&dirExtDirty[i], 0, __ATOMIC_ACQ_REL)
+            && disk_write_block(dirBlocks[rootDirBlocks + i], dirExtBlockNo[i] + dataStart) < 0) {
+            dirExtDirty[i] = 1;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// Free-space bitmap over the data blocks, one bit per FAT entry, set
+// when the block is free. It mirrors fat_get() == FAT_UNALLOCATED and
+// is filled in one FAT block at a time, the first time the allocator
+// looks at that part of the disk; freeBlockCount counts free blocks in
+// the parts filled in so far.
+#define FREE_WORDS_PER_FAT_BLOCK (FAT_ENTRIES_PER_BLOCK / 64)
+
+uint64_t *freeMap = NULL;
+int freeMapWords = 0;
+char *freeMapBuilt = NULL; // per FAT block, 1 once its bits are filled in
+int freeMapBlocks = 0; // FAT blocks covering the data blocks
+int freeMapBlocksBuilt = 0;
+int freeBlockCount = 0;
+int freeMapRover = 0; // word where the next unhinted search starts
+
+// Blocks freed by vsdelete that the host file still backs. They are
+// unallocated in the FAT but stay out of the free map until
+// reclaim_blocks has punched them, so no new file can be given one
+// and then lose its data to the punch. Guarded by allocLock.
+//
+// With a journal, a crash before the delete commits brings the file
+// back, so its blocks must keep their contents until then: they wait
+// in reclaimPending, and journal_round punches them once committed.
+// Blocks taken since the last round are free in the committed state,
+// so those go straight to reclaimQueue.
+ExtentMap reclaimQueue;
+ExtentMap reclaimPending; // freed by deletes not yet committed
+ExtentMap reclaimCommitting; // freed by the transaction being committed
+ExtentMap reclaimTaken; // the runs reclaim_blocks is punching
+uint64_t *freshMap = NULL; // blocks taken since the last commit round
+int deferReclaim = 0; // VSFS_DEFER_RECLAIM: punch at vssync, not at every vsdelete
+int reclaim_blocks();
+
+void build_free_map() {
+    free(freeMap);
+    free(freeMapBuilt);
+    freeMapWords = (dataBlocks + 63) / 64;
+    freeMap = (uint64_t *)calloc(freeMapWords > 0 ? freeMapWords : 1, sizeof(uint64_t));
+    freeMapBlocks = (dataBlocks + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+    freeMapBuilt = (char *)calloc(freeMapBlocks > 0 ? freeMapBlocks : 1, 1);
+    freeMapBlocksBuilt = 0;
+    freeBlockCount = 0;
+    freeMapRover = 0;
+    free(freshMap);
+    freshMap = (uint64_t *)calloc(freeMapWords > 0 ? freeMapWords : 1, sizeof(uint64_t));
+    free(reclaimQueue.extents);
+    memset(&reclaimQueue, 0, sizeof(ExtentMap));
+    free(reclaimPending.extents);
+    memset(&reclaimPending, 0, sizeof(ExtentMap));
+    free(reclaimCommitting.extents);
+    memset(&reclaimCommitting, 0, sizeof(ExtentMap));
+}
+
+static int is_block_free(int b) {
+    return b >= 0 && b < dataBlocks && (freeMap[b / 64] >> (b % 64)) & 1;
+}
+
+// Keep the runs of queue out of the free map bits of blocks first to
+// last - 1. Called with allocLock held.
+static void free_map_exclude(ExtentMap *queue, int first, int last) {
+    for (int r = 0; r < queue->count; r++) {
+        int lo = queue->extents[r].start;
+        int hi = lo + queue->extents[r].length;
+        for (int i = lo > first ? lo : first; i < hi && i < last; i++) {
+            // Only blocks still counted as free; a run may overlap one
+            // already excluded, or a block allocated since
+            if (is_block_free(i)) {
+                freeMap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+                freeBlockCount--;
+            }
+        }
+    }
+}
+
+// Fill in the bits for the data blocks mapped by FAT block p. Called
+// with allocLock held; a FAT block that cannot be read stays unfilled,
+// so its blocks look allocated.
+static void free_map_fill(int p) {
+    if (freeMapBuilt[p])
+        return;
+    int first = p * FAT_ENTRIES_PER_BLOCK;
+    int last = first + FAT_ENTRIES_PER_BLOCK;
+    if (last > dataBlocks)
+        last = dataBlocks;
+    pthread_mutex_lock(&fatTable.lock);
+    int *entries = table_page(&fatTable, p);
+    if (entries != NULL) {
+        for (int i = first; i < last; i++) {
+            if (entries[i - first] == FAT_UNALLOCATED) {
+                freeMap[i / 64] |= (uint64_t) 1 << (i % 64);
+                freeBlockCount++;
+            }
+        }
+        free_map_exclude(&reclaimQueue, first, last);
+        free_map_exclude(&reclaimPending, first, last);
+        free_map_exclude(&reclaimCommitting, first, last);
+        free_map_exclude(&reclaimTaken, first, last);
+        freeMapBuilt[p] = 1;
+        freeMapBlocksBuilt++;
+    }
+    pthread_mutex_unlock(&fatTable.lock);
+}
+
+// Mark free block b allocated. Called with allocLock held.
+static void take_block(int b) {
+    freeMap[b / 64] &= ~((uint64_t) 1 << (b % 64));
+    freshMap[b / 64] |= (uint64_t) 1 << (b % 64);
+    freeBlockCount--;
+    // Mark the block as allocated in the FAT table, but has no next entry yet!
+    fat_set(b, FAT_NO_NEXT);
+}
+
+// Find a free block in the FAT table and mark it allocated. The hint
+// block is taken if it is free, so that a file grows contiguously;
+// otherwise the search continues from where the last one stopped.
+static int take_free_block(int hint) {
+    int block = -1;
+    int scanned = 0; // free-map words examined
+    STAT_ADD(allocCalls, 1);
+    pthread_mutex_lock(&allocLock);
+    if (freeBlockCount == 0 && freeMapBlocksBuilt == freeMapBlocks) {
+        pthread_mutex_unlock(&allocLock);
+        return -1; // No free blocks available
+    }
+
+    if (hint >= 0 && hint < dataBlocks)
+        free_map_fill(hint / FAT_ENTRIES_PER_BLOCK);
+    if (is_block_free(hint)) {
+        block = hint;
+    } else {
+        // Look after the hint first, then scan whole words from the rover
+        if (hint >= 0 && hint < dataBlocks) {
+            uint64_t rest = freeMap[hint / 64] & (~(uint64_t) 0 << (hint % 64));
+            if (rest != 0)
+                block = (hint / 64) * 64 + __builtin_ctzll(rest);
+        }
+        for (int n = 0; block == -1 && n < freeMapWords; n++) {
+            int w = (freeMapRover + n) % freeMapWords;
+            free_map_fill(w / FREE_WORDS_PER_FAT_BLOCK);
+            scanned++;
+            if (freeMap[w] != 0) {
+                block = w * 64 + __builtin_ctzll(freeMap[w]);
+                freeMapRover = w;
+            }
+        }
+    }
+    STAT_ADD(allocScanWords, scanned);
+    if (block == -1) {
+        pthread_mutex_unlock(&allocLock);
+        return -1;
+    }
+
+    take_block(block);
+    pthread_mutex_unlock(&allocLock);
+    return block;
+}
+
+// As take_free_block, falling back to the blocks waiting to be punched
+int find_free_block(int hint) {
+    int block = take_free_block(hint);
+    if (block == -1 && reclaim_blocks() > 0)
+        block = take_free_block(hint);
+    return block;
+}
+
+// Allocate up to want consecutive blocks, the first one chosen as by
+// find_free_block(hint). Returns the first block and sets *count, or
+// returns -1 when the disk is full.
+int find_free_run(int hint, int want, int *count) {
+    int block = find_free_block(hint);
+    if (block == -1)
+        return -1;
+    int n = 1;
+    pthread_mutex_lock(&allocLock);
+    while (n < want && block + n < dataBlocks) {
+        free_map_fill((block + n) / FAT_ENTRIES_PER_BLOCK);
+        if (!is_block_free(block + n))
+            break;
+        take_block(block + n);
+        n++;
+    }
+    pthread_mutex_unlock(&allocLock);
+    *count = n;
+    return block;
+}
+
+// Allocate the lowest run of want consecutive free blocks. Returns its
+// first block, or -1 if no free run is that long.
+static int find_free_span(int want) {
+    int found = -1;
+    int start = 0, length = 0;
+    pthread_mutex_lock(&allocLock);
+    for (int b = 0; b < dataBlocks && found == -1; b++) {
+        if (b % FAT_ENTRIES_PER_BLOCK == 0)
+            free_map_fill(b / FAT_ENTRIES_PER_BLOCK);
+        // Whole words at a time where they are all free or all taken
+        if (b % 64 == 0 && b + 64 <= dataBlocks
+            && (freeMap[b / 64] == 0 || freeMap[b / 64] == ~(uint64_t) 0)) {
+            if (freeMap[b / 64] == 0) {
+                length = 0;
+            } else {
+                if (length == 0)
+                    start = b;
+                length += 64;
+                if (length >= want)
+                    found = start;
+            }
+            b += 63;
+            continue;
+        }
+        if (!is_block_free(b)) {
+            length = 0;
+            continue;
+        }
+        if (length++ == 0)
+            start = b;
+        if (length >= want)
+            found = start;
+    }
+    if (found != -1) {
+        for (int b = found; b < found + want; b++)
+            take_block(b);
+    }
+    pthread_mutex_unlock(&allocLock);
+    return found;
+}
+
+// Return block b to the free pool
+void release_block(int b) {
+    pthread_mutex_lock(&allocLock);
+    fat_set(b, FAT_UNALLOCATED);
+    if (b < dataBlocks && freeMapBuilt[b / FAT_ENTRIES_PER_BLOCK] && !is_block_free(b)) {
+        freeMap[b / 64] |= (uint64_t) 1 << (b % 64);
+        freeBlockCount++;
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+    
+// Check if the file descriptor is valid
+int checkFdValidity(int fd){
+    if (fd < 0 || fd >= __atomic_load_n(&openFileCount, __ATOMIC_ACQUIRE) || fd_entry(fd)->fd == -1) {
+        return -1;
+    }
+    return fd;
+}
+
+// In-memory index from filename to directory slot. Each bucket is a
+// list of slots linked through dirHashNext; -1 ends a list. Free slots
+// are kept on the dirFreeSlots stack. All of it is guarded by dirLock.
+int *dirHashHead = NULL;
+int *dirHashNext = NULL;
+int dirHashSize = 0; // power of two
+int *dirFreeSlots = NULL;
+int dirFreeCount = 0;
+
+static unsigned int dir_hash(const char *filename) {
+    // FNV-1a over the stored (possibly truncated) name
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME_LENGTH - 1 && filename[i] != '\0'; i++) {
+        h ^= (unsigned char) filename[i];
+        h *= 16777619u;
+    }
+    return h & (dirHashSize - 1);
+}
+
+void dir_index_insert(int slot) {
+    unsigned int h = dir_hash(dir_entry(slot)->filename);
+    dirHashNext[slot] = dirHashHead[h];
+    dirHashHead[h] = slot;
+}
+
+void dir_index_remove(int slot) {
+    int *p = &dirHashHead[dir_hash(dir_entry(slot)->filename)];
+    while (*p != -1 && *p != slot)
+        p = &dirHashNext[*p];
+    if (*p == slot)
+        *p = dirHashNext[slot];
+    dirHashNext[slot] = -1;
+}
+
+// Rehash every used slot into a table of at least 2 * dirLength
+// buckets. dirHashNext must have dirLength entries.
+static void dir_hash_rebuild() {
+    dirHashSize = 1;
+    while (dirHashSize < 2 * dirLength)
+        dirHashSize <<= 1;
+    free(dirHashHead);
+    dirHashHead = (int *)malloc(dirHashSize * sizeof(int));
+    for (int h = 0; h < dirHashSize; h++)
+        dirHashHead[h] = -1;
+    for (int i = 0; i < dirLength; i++) {
+        dirHashNext[i] = -1;
+        if (dir_entry(i)->filename[0] != '\0')
+            dir_index_insert(i);
+    }
+}
+
+// Index every used slot of the directory and collect the free ones,
+// lowest slot on top
+void dir_index_build() {
+    free(dirHashNext);
+    free(dirFreeSlots);
+    free(dirOpenFd);
+    dirHashNext = (int *)malloc(dirLength * sizeof(int));
+    dirFreeSlots = (int *)malloc(dirLength * sizeof(int));
+    dirOpenFd = (int *)malloc(dirLength * sizeof(int));
+    dirFreeCount = 0;
+    for (int i = dirLength - 1; i >= 0; i--) {
+        dirOpenFd[i] = -1;
+        if (dir_entry(i)->filename[0] == '\0')
+            dirFreeSlots[dirFreeCount++] = i;
+    }
+    dir_hash_rebuild();
+}
+
+// Set up dirBlocks over the root directory and the chain of extension
+// blocks recorded in the superblock, then index the entries. Called by
+// vsmount once the FAT can be read.
+static int dir_load() {
+    // Images without a magic have nowhere to record extension blocks
+    int maxExt = dataBlocks < MAX_DIR_EXT_BLOCKS ? dataBlocks : MAX_DIR_EXT_BLOCKS;
+    if (superblock.magic != VSFS_MAGIC)
+        maxExt = 0;
+    dirBlockCapacity = rootDirBlocks + maxExt;
+    dirBlocks = (DirectoryEntry **)calloc(dirBlockCapacity, sizeof(DirectoryEntry *));
+    dirExtBlockNo = (int *)malloc((maxExt + 1) * sizeof(int));
+    dirExtDirty = (char *)calloc(maxExt + 1, 1);
+    for (int k = 0; k < rootDirBlocks; k++)
+        dirBlocks[k] = &rootDir[(size_t) k * DIR_ENTRIES_PER_BLOCK];
+    dirBlockCount = rootDirBlocks;
+
+    int ext = maxExt > 0 ? superblock.dirExtBlocks : 0;
+    int b = superblock.dirExtBlock;
+    for (int i = 0; i < ext; i++) {
+        if (b < 0 || b >= dataBlocks || i == maxExt) {
+            vs_log(LOG_ERROR, "Error in vsmount: Directory extension chain is broken\n");
+            return -1;
+        }
+        DirectoryEntry *blk = (DirectoryEntry *)mapped_block(b + dataStart);
+        if (blk == NULL) {
+            blk = (DirectoryEntry *)malloc(BLOCKSIZE);
+            if (disk_read_block(blk, b + dataStart) < 0) {
+                free(blk);
+                return -1;
+            }
+        }
+        dirExtBlockNo[i] = b;
+        dirBlocks[dirBlockCount++] = blk;
+        b = fat_get(b);
+    }
+    dirLength = dirBlockCount * DIR_ENTRIES_PER_BLOCK;
+    dir_index_build();
+    return 0;
+}
+
+// Chain one more block of free slots onto the directory. Called with
+// dirLock held for writing. Returns -1 when the directory cannot grow.
+static int dir_grow() {
+    if (dirBlockCount == dirBlockCapacity)
+        return -1;
+    int ext = dirBlockCount - rootDirBlocks;
+    int b = find_free_block(ext > 0 ? dirExtBlockNo[ext - 1] + 1 : -1);
+    if (b == -1)
+        return -1;
+    cache_discard(b + dataStart); // written directly, never through the cache
+    int newLength = dirLength + DIR_ENTRIES_PER_BLOCK;
+    DirectoryEntry *blk = (DirectoryEntry *)mapped_block(b + dataStart);
+    if (blk == NULL)
+        blk = (DirectoryEntry *)malloc(BLOCKSIZE);
+    int *next = (int *)realloc(dirHashNext, newLength * sizeof(int));
+    if (next != NULL)
+        dirHashNext = next;
+    int *freeSlots = (int *)realloc(dirFreeSlots, newLength * sizeof(int));
+    if (freeSlots != NULL)
+        dirFreeSlots = freeSlots;
+    int *openFd = (int *)realloc(dirOpenFd, newLength * sizeof(int));
+    if (openFd != NULL)
+        dirOpenFd = openFd;
+    if (blk == NULL || next == NULL || freeSlots == NULL || openFd == NULL) {
+        if (vs_map == NULL)
+            free(blk);
+        release_block(b);
+        return -1;
+    }
+
+    memset(blk, 0, BLOCKSIZE);
+    for (int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        blk[i].startBlock = FAT_UNALLOCATED;
+        blk[i].extentBlock = FAT_NO_NEXT;
+    }
+    if (ext == 0)
+        superblock.dirExtBlock = b;
+    else
+        fat_set(dirExtBlockNo[ext - 1], b);
+    superblock.dirExtBlocks = ext + 1;
+    __atomic_store_n(&metaDirty[0], 1, __ATOMIC_RELEASE);
+    journal_log(0, offsetof(SuperBlock, dirExtBlock), &superblock.dirExtBlock, 2 * sizeof(int));
+    dirExtBlockNo[ext] = b;
+    dirBlocks[dirBlockCount++] = blk;
+
+    for (int i = newLength - 1; i >= dirLength; i--) {
+        dirHashNext[i] = -1;
+        dirOpenFd[i] = -1;
+        dirFreeSlots[dirFreeCount++] = i;
+    }
+    // The block may hold anything on disk, so every slot is logged
+    for (int i = dirLength; i < newLength; i++)
+        dir_mark_dirty(i);
+    dirLength = newLength;
+    if (dirHashSize < 2 * dirLength)
+        dir_hash_rebuild();
+    return 0;
+}
+
+// Add FD_CHUNK entries to the open file table, lowest descriptor first
+// on the free list. Called with dirLock held for writing.
+static int fd_table_grow() {
+    if (openFileCount == MAX_OPEN_FILES)
+        return -1;
+    OpenFileEntry *chunk = (OpenFileEntry *)calloc(FD_CHUNK, sizeof(OpenFileEntry));
+    if (chunk == NULL)
+        return -1;
+    for (int i = FD_CHUNK - 1; i >= 0; i--) {
+        chunk[i].fd = -1;
+        chunk[i].mode = -1;
+        pthread_rwlock_init(&chunk[i].lock, NULL);
+        pthread_mutex_init(&chunk[i].cursorLock, NULL);
+        chunk[i].nextFree = fdFreeHead;
+        fdFreeHead = openFileCount + i;
+    }
+    openFileChunks[openFileCount / FD_CHUNK] = chunk;
+    __atomic_store_n(&openFileCount, openFileCount + FD_CHUNK, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int find_file_by_name(const char *filename) {
+    if (filename[0] == '\0')
+        return -1; // empty names mark free slots
+    for (int i = dirHashHead[dir_hash(filename)]; i != -1; i = dirHashNext[i]) {
+        if (strncmp(dir_entry(i)->filename, filename, MAX_FILENAME_LENGTH) == 0) {
+            return i; // File found, return its index
+        }
+    }
+    return -1; // File not found
+}
+
+// With the journal on, extent blocks written since the last checkpoint
+// are held here instead of in place, like the rest of the metadata;
+// the checkpoint writes them. Buckets are chained through next and
+// guarded by extentBufLock.
+typedef struct ExtentBuf {
+    int block; // data block
+    struct ExtentBuf *next;
+    ExtentBlock data;
+} ExtentBuf;
+
+#define EXTENT_BUF_BUCKETS 64
+
+ExtentBuf *extentBufs[EXTENT_BUF_BUCKETS];
+int extentBufCount = 0;
+pthread_mutex_t extentBufLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int extent_block_read(ExtentBlock *eb, int b) {
+    if (journalActive && vs_map == NULL) {
+        pthread_mutex_lock(&extentBufLock);
+        for (ExtentBuf *e = extentBufs[b % EXTENT_BUF_BUCKETS]; e != NULL; e = e->next) {
+            if (e->block == b) {
+                memcpy(eb, &e->data, sizeof(ExtentBlock));
+                pthread_mutex_unlock(&extentBufLock);
+                return 0;
+            }
+        }
+        pthread_mutex_unlock(&extentBufLock);
+    }
+    return read_block(eb, b + dataStart);
+}
+
+static int extent_block_write(ExtentBlock *eb, int b) {
+    if (!journalActive)
+        return write_block(eb, b + dataStart);
+    journal_log(b + dataStart, 0, eb, sizeof(ExtentBlock)); // whole, see journal_log
+    if (vs_map != NULL)
+        return write_block(eb, b + dataStart);
+
+    cache_discard(b + dataStart); // the held copy is newer
+
+    pthread_mutex_lock(&extentBufLock);
+    ExtentBuf *e = extentBufs[b % EXTENT_BUF_BUCKETS];
+    while (e != NULL && e->block != b)
+        e = e->next;
+    if (e == NULL) {
+        e = (ExtentBuf *)malloc(sizeof(ExtentBuf));
+        if (e == NULL) {
+            pthread_mutex_unlock(&extentBufLock);
+            return -1;
+        }
+        e->block = b;
+        e->next = extentBufs[b % EXTENT_BUF_BUCKETS];
+        extentBufs[b % EXTENT_BUF_BUCKETS] = e;
+        extentBufCount++;
+    }
+    memcpy(&e->data, eb, sizeof(ExtentBlock));
+    if (extentBufCount > MAX_EXTENT_BUFS)
+        __atomic_store_n(&journalPressure, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&extentBufLock);
+    return 0;
+}
+
+// Forget a held extent block; call before releasing it
+static void extent_block_drop(int b) {
+    pthread_mutex_lock(&extentBufLock);
+    for (ExtentBuf **p = &extentBufs[b % EXTENT_BUF_BUCKETS]; *p != NULL; p = &(*p)->next) {
+        if ((*p)->block == b) {
+            ExtentBuf *e = *p;
+            *p = e->next;
+            free(e);
+            extentBufCount--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&extentBufLock);
+}
+
+// Write the held extent blocks in place and forget them
+static int extent_bufs_flush() {
+    int ret = 0;
+    pthread_mutex_lock(&extentBufLock);
+    for (int h = 0; h < EXTENT_BUF_BUCKETS; h++) {
+        while (extentBufs[h] != NULL) {
+            ExtentBuf *e = extentBufs[h];
+            if (disk_write_block(&e->data, e->block + dataStart) < 0)
+                ret = -1;
+            extentBufs[h] = e->next;
+            free(e);
+        }
+    }
+    extentBufCount = 0;
+    pthread_mutex_unlock(&extentBufLock);
+    return ret;
+}
+
+// Add the run of count blocks at start to the end of map, merging it
+// into the last extent when it continues it. Returns the index of the
+// first extent that changed.
+static int extent_map_add(ExtentMap *map, int start, int count) {
+    map->blocks += count;
+    if (map->count > 0) {
+        Extent *last = &map->extents[map->count - 1];
+        if (last->start + last->length == start) {
+            last->length += count;
+            return map->count - 1;
+        }
+    }
+    if (map->count == map->capacity) {
+        int capacity = map->capacity > 0 ? 2 * map->capacity : INLINE_EXTENTS;
+        Extent *grown = (Extent *)realloc(map->extents, capacity * sizeof(Extent));
+        if (grown == NULL) {
+            map->blocks -= count;
+            return -1;
+        }
+        map->extents = grown;
+        map->capacity = capacity;
+    }
+    map->extents[map->count].start = start;
+    map->extents[map->count].length = count;
+    return map->count++;
+}
+
+static int extent_chain_add(ExtentMap *map, int block) {
+    int *grown = (int *)realloc(map->chain, (map->chainCount + 1) * sizeof(int));
+    if (grown == NULL)
+        return -1;
+    map->chain = grown;
+    map->chain[map->chainCount++] = block;
+    return 0;
+}
+
+void extent_map_free(ExtentMap *map) {
+    free(map->extents);
+    free(map->chain);
+    memset(map, 0, sizeof(ExtentMap));
+}
+
+// Unallocate the runs of freed in the FAT and queue them to be punched,
+// those the committed metadata may still point at only after the commit
+static void free_runs(ExtentMap *freed) {
+    pthread_mutex_lock(&allocLock);
+    for (int r = 0; r < freed->count; r++) {
+        Extent *e = &freed->extents[r];
+        for (int b = e->start; b < e->start + e->length; b++) {
+            fat_set(b, FAT_UNALLOCATED);
+            int fresh = !journalActive || (freshMap[b / 64] & ((uint64_t) 1 << (b % 64)));
+            if (extent_map_add(fresh ? &reclaimQueue : &reclaimPending, b, 1) < 0) {
+                // Without room to queue it the block goes unpunched
+                if (freeMapBuilt[b / FAT_ENTRIES_PER_BLOCK] && !is_block_free(b)) {
+                    freeMap[b / 64] |= (uint64_t) 1 << (b % 64);
+                    freeBlockCount++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+
+static int extent_cmp(const void *a, const void *b) {
+    const Extent *x = (const Extent *) a;
+    const Extent *y = (const Extent *) b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+int punchUnsupported = 0; // the host file system cannot punch holes
+
+pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER; // one reclaim_blocks at a time
+
+// Punch holes for the blocks of queue, so the host file stops backing
+// them, then return them to the free map. Adjacent runs become one
+// fallocate call. Returns the number of blocks reclaimed.
+static int reclaim_runs(ExtentMap *queue) {
+    pthread_mutex_lock(&reclaimLock);
+    pthread_mutex_lock(&allocLock);
+    // Blocks freed from here on queue up for the next call
+    reclaimTaken = *queue;
+    memset(queue, 0, sizeof(ExtentMap));
+    if (reclaimTaken.count == 0) {
+        extent_map_free(&reclaimTaken);
+        pthread_mutex_unlock(&allocLock);
+        pthread_mutex_unlock(&reclaimLock);
+        return 0;
+    }
+    Extent *runs = reclaimTaken.extents;
+    int blocks = reclaimTaken.blocks;
+    qsort(runs, reclaimTaken.count, sizeof(Extent), extent_cmp);
+    int merged = 0;
+    for (int r = 0; r < reclaimTaken.count; r++) {
+        if (merged > 0 && runs[merged - 1].start + runs[merged - 1].length == runs[r].start)
+            runs[merged - 1].length += runs[r].length;
+        else
+            runs[merged++] = runs[r];
+    }
+    reclaimTaken.count = merged;
+    pthread_mutex_unlock(&allocLock);
+
+    for (int r = 0; r < merged && !punchUnsupported; r++) {
+        STAT_ADD(syscalls, 1);
+        STAT_ADD(punches, 1);
+        if (fallocate(vs_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t) (runs[r].start + dataStart) * BLOCKSIZE,
+                      (off_t) runs[r].length * BLOCKSIZE) < 0) {
+            vs_log(LOG_DEBUG, "fallocate could not punch a hole; freed blocks stay backed\n");
+            punchUnsupported = 1;
+        }
+    }
+
+    pthread_mutex_lock(&allocLock);
+    for (int r = 0; r < merged; r++) {
+        for (int b = runs[r].start; b < runs[r].start + runs[r].length; b++) {
+            if (freeMapBuilt[b / FAT_ENTRIES_PER_BLOCK] && !is_block_free(b)) {
+                freeMap[b / 64] |= (uint64_t) 1 << (b % 64);
+                freeBlockCount++;
+            }
+        }
+    }
+    extent_map_free(&reclaimTaken);
+    pthread_mutex_unlock(&allocLock);
+    pthread_mutex_unlock(&reclaimLock);
+    STAT_ADD(reclaimedBlocks, blocks);
+    return blocks;
+}
+
+// Reclaim the queued blocks of deleted files. Those waiting for a
+// commit are left to journal_round.
+int reclaim_blocks() {
+    return reclaim_runs(&reclaimQueue);
+}
+
+// Set aside the blocks freed by the operations a commit round has
+// taken the records of. Called with the journal gate closed; the
+// blocks taken so far are in the round as well.
+static void reclaim_hold() {
+    pthread_mutex_lock(&allocLock);
+    reclaimCommitting = reclaimPending;
+    memset(&reclaimPending, 0, sizeof(ExtentMap));
+    memset(freshMap, 0, (freeMapWords > 0 ? freeMapWords : 1) * sizeof(uint64_t));
+    pthread_mutex_unlock(&allocLock);
+}
+
+// Once the round has committed, punch the blocks set aside for it;
+// if it failed, they wait for the next one
+static void reclaim_settle(int committed) {
+    if (committed) {
+        reclaim_runs(&reclaimCommitting);
+        return;
+    }
+    pthread_mutex_lock(&allocLock);
+    for (int r = 0; r < reclaimCommitting.count; r++) {
+        Extent *e = &reclaimCommitting.extents[r];
+        if (extent_map_add(&reclaimPending, e->start, e->length) < 0)
+            break; // the rest go unpunched
+    }
+    extent_map_free(&reclaimCommitting);
+    pthread_mutex_unlock(&allocLock);
+}
+
+// Load the extents of the file in directory slot slot into map
+int extent_map_load(ExtentMap *map, int slot) {
+    DirectoryEntry *file = dir_entry(slot);
+    memset(map, 0, sizeof(ExtentMap));
+    for (int i = 0; i < file->extentCount && i < INLINE_EXTENTS; i++) {
+        if (extent_map_add(map, file->extents[i].start, file->extents[i].length) < 0)
+            return -1;
+    }
+    ExtentBlock eb;
+    for (int b = file->extentBlock; b != FAT_NO_NEXT; b = eb.next) {
+        if (extent_block_read(&eb, b) < 0 || extent_chain_add(map, b) < 0)
+            return -1;
+        for (int i = 0; i < eb.count; i++) {
+            if (extent_map_add(map, eb.extents[i].start, eb.extents[i].length) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Write extents from index from onwards back to directory slot slot and its
+// extent blocks, allocating extent blocks as the list grows.
+int extent_map_store(ExtentMap *map, int slot, int from) {
+    DirectoryEntry *file = dir_entry(slot);
+    for (int i = from; i < map->count && i < INLINE_EXTENTS; i++)
+        file->extents[i] = map->extents[i];
+
+    int first = from < INLINE_EXTENTS ? 0 : (from - INLINE_EXTENTS) / EXTENTS_PER_BLOCK;
+    int needed = map->count <= INLINE_EXTENTS ? 0
+        : (map->count - INLINE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    if (map->chainCount < needed && map->chainCount > 0 && first > map->chainCount - 1)
+        first = map->chainCount - 1; // its next pointer changes
+    while (map->chainCount < needed) {
+        int hint = map->chainCount > 0 ? map->chain[map->chainCount - 1] + 1 : -1;
+        int b = find_free_block(hint);
+        if (b == -1 || extent_chain_add(map, b) < 0) {
+            if (b != -1)
+                release_block(b);
+            vs_log(LOG_ERROR, "Error in vsappend: No free block for the extent list\n");
+            return -1;
+        }
+    }
+
+    ExtentBlock eb;
+    for (int j = first; j < needed; j++) {
+        int base = INLINE_EXTENTS + j * EXTENTS_PER_BLOCK;
+        memset(&eb, 0, sizeof(ExtentBlock));
+        eb.next = j + 1 < needed ? map->chain[j + 1] : FAT_NO_NEXT;
+        eb.count = map->count - base < (int) EXTENTS_PER_BLOCK ? map->count - base : (int) EXTENTS_PER_BLOCK;
+        memcpy(eb.extents, &map->extents[base], eb.count * sizeof(Extent));
+        if (extent_block_write(&eb, map->chain[j]) < 0)
+            return -1;
+    }
+
+    file->extentCount = map->count;
+    file->extentBlock = needed > 0 ? map->chain[0] : FAT_NO_NEXT;
+    dir_mark_dirty(slot);
+    return 0;
+}
+
+// Map data block newBlock in place of block old, splitting its extent,
+// and write the change back to directory slot slot. Returns 0 on
+// success, -1 with map unchanged on failure.
+static int extent_map_replace(ExtentMap *map, int slot, int old, int newBlock) {
+    int i;
+    for (i = 0; i < map->count; i++) {
+        if (old >= map->extents[i].start && old < map->extents[i].start + map->extents[i].length)
+            break;
+    }
+    if (i == map->count)
+        return -1;
+    Extent *saved = (Extent *)malloc(map->count * sizeof(Extent));
+    if (saved == NULL)
+        return -1;
+    memcpy(saved, map->extents, map->count * sizeof(Extent));
+    int savedCount = map->count;
+
+    // [start, old) [newBlock] [old + 1, end): up to two more extents
+    if (map->count + 2 > map->capacity) {
+        Extent *grown = (Extent *)realloc(map->extents, (map->count + 2) * sizeof(Extent));
+        if (grown == NULL) {
+            free(saved);
+            return -1;
+        }
+        map->extents = grown;
+        map->capacity = map->count + 2;
+    }
+    Extent e = map->extents[i];
+    Extent pieces[3];
+    int n = 0;
+    if (old > e.start)
+        pieces[n++] = (Extent) { e.start, old - e.start };
+    pieces[n++] = (Extent) { newBlock, 1 };
+    if (old + 1 < e.start + e.length)
+        pieces[n++] = (Extent) { old + 1, e.start + e.length - old - 1 };
+    memmove(&map->extents[i + n], &map->extents[i + 1], (map->count - i - 1) * sizeof(Extent));
+    memcpy(&map->extents[i], pieces, n * sizeof(Extent));
+    map->count += n - 1;
+    map->hint = 0;
+    if (extent_map_store(map, slot, i) < 0) {
+        memcpy(map->extents, saved, savedCount * sizeof(Extent));
+        map->count = savedCount;
+        free(saved);
+        return -1;
+    }
+    free(saved);
+    return 0;
+}
+
+// Extent of map holding data block b, starting the search at the hint
+static int extent_find(ExtentMap *map, int b) {
+    int h = __atomic_load_n(&map->hint, __ATOMIC_RELAXED);
+    for (int n = 0; n < map->count; n++) {
+        int i = (h + n) % map->count;
+        if (b >= map->extents[i].start && b < map->extents[i].start + map->extents[i].length) {
+            __atomic_store_n(&map->hint, i, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The block after b in the file, FAT_NO_NEXT past its last block
+static int extent_next(ExtentMap *map, int b) {
+    int i = extent_find(map, b);
+    if (i == -1)
+        return FAT_NO_NEXT;
+    if (b + 1 < map->extents[i].start + map->extents[i].length)
+        return b + 1;
+    return i + 1 < map->count ? map->extents[i + 1].start : FAT_NO_NEXT;
+}
+
+// The file's index-th block, FAT_NO_NEXT past its last block
+static int extent_block_at(ExtentMap *map, int index) {
+    for (int i = 0; i < map->count; i++) {
+        if (index < map->extents[i].length)
+            return map->extents[i].start + index;
+        index -= map->extents[i].length;
+    }
+    return FAT_NO_NEXT;
+}
+
+// Next block of the open file after block, by extents or by the FAT
+static int file_next_block(OpenFileEntry *entry, int block) {
+    if (extentMode)
+        return extent_next(&entry->extentMap, block);
+    return fat_get(block);
+}
+
+// Forget all skip index entries except the first one, allocating the
+// index on first use. Returns -1 if it cannot be allocated.
+static int skip_reset(OpenFileEntry *entry) {
+    if (entry->skipCapacity == 0) {
+        entry->skipIndex = (int *)malloc(16 * sizeof(int));
+        if (entry->skipIndex == NULL)
+            return -1;
+        entry->skipCapacity = 16;
+    }
+    entry->skipIndex[0] = dir_entry(entry->dirIndex)->startBlock;
+    entry->skipCount = 1;
+    return 0;
+}
+
+// Record that block is the file's index-th block if that extends the
+// skip index. Called with the cursor lock held.
+static void skip_note(OpenFileEntry *entry, int index, int block) {
+    if (index % SKIP_INTERVAL != 0 || index / SKIP_INTERVAL != entry->skipCount
+        || block == FAT_NO_NEXT)
+        return;
+    if (entry->skipCount == entry->skipCapacity) {
+        int *grown = (int *)realloc(entry->skipIndex, 2 * entry->skipCapacity * sizeof(int));
+        if (grown == NULL)
+            return;
+        entry->skipIndex = grown;
+        entry->skipCapacity *= 2;
+    }
+    entry->skipIndex[entry->skipCount++] = block;
+}
+
+// Find the file's index-th block, starting from the nearest skip index
+// entry at or below it, or from the extents in extent mode. Called
+// with the cursor lock held.
+static int locate_block(OpenFileEntry *entry, int index) {
+    if (dir_entry(entry->dirIndex)->startBlock == FAT_INLINE)
+        return FAT_INLINE;
+    if (extentMode)
+        return extent_block_at(&entry->extentMap, index);
+    int k = index / SKIP_INTERVAL;
+    if (k >= entry->skipCount)
+        k = entry->skipCount - 1;
+    int block = entry->skipIndex[k];
+    int i = k * SKIP_INTERVAL;
+    while (i < index && block != FAT_NO_NEXT) {
+        block = fat_get(block);
+        i++;
+        skip_note(entry, i, block);
+    }
+    return block;
+}
+
+// Milliseconds on a monotonic clock, for the tail flush policy
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Make tailBuf hold the first tailOffset bytes of the tail block.
+// Called with the open file's lock held for writing.
+static int tail_load(OpenFileEntry *entry) {
+    if (entry->tailLoaded)
+        return 0;
+    if (entry->tailOffset > 0) {
+        if (read_block(entry->tailBuf, entry->tailBlock + dataStart) < 0)
+            return -1;
+    }
+    memset(entry->tailBuf + entry->tailOffset, 0, BLOCKSIZE - entry->tailOffset);
+    entry->tailLoaded = 1;
+    return 0;
+}
+
+// Write the tail buffer to the tail block if it holds unwritten bytes.
+// Called with the open file's lock held for writing.
+int tail_flush(OpenFileEntry *entry) {
+    if (entry->tailPending == 0)
+        return 0;
+    if (write_block(entry->tailBuf, entry->tailBlock + dataStart) < 0)
+        return -1;
+    entry->tailPending = 0;
+    entry->tailAppends = 0;
+    return 0;
+}
+
+// Give the file its own copy of its tail block before an append
+// changes it, if a clone shares the block. Extent mode only.
+static int tail_unshare(OpenFileEntry *entry) {
+    int old = entry->tailBlock;
+    if (!extentMode || !blocks_shared() || ref_count(old) <= 0)
+        return 0;
+
+    // Copy first: the block cannot change while it is shared. Taking
+    // the reference off it can fail if the other owner copied away
+    // meanwhile, and then the copy is not needed.
+    ExtentMap *map = &entry->extentMap;
+    int block = find_free_block(map->extents[map->count - 1].start + map->extents[map->count - 1].length);
+    if (block == -1)
+        return -1;
+    char *mapped = mapped_block(old + dataStart);
+    if (mapped != NULL)
+        memcpy(mapped_block(block + dataStart), mapped, BLOCKSIZE);
+    else if (tail_load(entry) < 0) {
+        release_block(block);
+        return -1;
+    }
+    if (ref_add(old, -1) <= 0) {
+        release_block(block);
+        return 0;
+    }
+    if (extent_map_replace(map, entry->dirIndex, old, block) < 0) {
+        ref_add(old, 1);
+        release_block(block);
+        return -1;
+    }
+    sum_copy(old, block);
+    if (mapped != NULL) {
+        __atomic_store_n(&mapDirty[block + dataStart], 1, __ATOMIC_RELEASE);
+    } else {
+        // The whole buffer goes to the new block
+        if (entry->tailPending == 0)
+            entry->tailSince = now_ms();
+        entry->tailPending = entry->tailOffset;
+    }
+    entry->tailBlock = block;
+
+    DirectoryEntry *file = dir_entry(entry->dirIndex);
+    if (file->startBlock == old) {
+        file->startBlock = block;
+        dir_mark_dirty(entry->dirIndex);
+    }
+    pthread_mutex_lock(&entry->cursorLock);
+    if (entry->readBlock == old)
+        entry->readBlock = block;
+    pthread_mutex_unlock(&entry->cursorLock);
+    STAT_ADD(cowCopies, 1);
+    return 0;
+}
+
+// Whether the flush policy says the buffered bytes are due
+static int tail_due(OpenFileEntry *entry) {
+    if (entry->tailPending >= tailFlushBytes)
+        return 1;
+    if (tailFlushCount > 0 && entry->tailAppends >= tailFlushCount)
+        return 1;
+    return tailFlushMs > 0 && now_ms() - entry->tailSince >= tailFlushMs;
+}
+
+// Flush the tail buffer of every open file
+int tail_flush_all() {
+    int ret = 0;
+    pthread_rwlock_rdlock(&dirLock);
+    for (int i = 0; i < openFileCount; i++) {
+        OpenFileEntry *entry = fd_entry(i);
+        if (entry->fd == -1)
+            continue;
+        pthread_rwlock_wrlock(&entry->lock);
+        if (tail_flush(entry) < 0)
+            ret = -1;
+        pthread_rwlock_unlock(&entry->lock);
+    }
+    pthread_rwlock_unlock(&dirLock);
+    return ret;
+}
+
+/********************************************************************
+    Metadata journal
+
+    Changes to the FAT, the directory, the superblock and extent
+    blocks are logged as redo records, each the new contents of a
+    byte range of a metadata block; a later change to the same range
+    overwrites the pending record. A commit writes the records logged
+    since the previous commit as one transaction after the previous
+    ones and makes it durable with one fsync. Callers that commit
+    while a commit is running wait and share the next one, so
+    concurrent commits cost one fsync between them.
+
+    With the journal on, metadata is written in place only by a
+    checkpoint: FAT pages stay resident while dirty, and extent
+    blocks are held in extentBufs. A checkpoint runs at vsumount and
+    whenever the journal is half full or the held metadata fills up.
+    It commits the pending records first, so that all it writes in
+    place is in the journal, then writes everything in place and
+    starts a new epoch, which empties the journal. Records that do
+    not fit in the journal are dropped; the checkpoint then stages
+    copies of the dirty metadata blocks in free data blocks and
+    starts the new epoch with a header that lists them before it
+    writes in place. vsmount copies staged blocks in place or replays
+    the transactions of the current epoch.
+
+    Operations that change metadata run between journal_begin and
+    journal_end; a commit waits for the running ones and holds new
+    ones back while it takes the pending records, so a transaction
+    never holds half an operation. Data is not journaled: a commit
+    writes dirty cached blocks first, but bytes still in a tail
+    buffer are only written by vssync, vsclose or VSFS_SYNC_COMMIT.
+    With MOUNT_MMAP the kernel may write metadata pages in place at
+    any time, committed or not, so a crash can leave uncommitted
+    metadata on disk; replay restores the committed changes but does
+    not undo the others.
+
+    journalLock guards the pending records, the gate and the commit
+    rounds. It is taken after every other lock.
+********************************************************************/
+typedef struct {
+    int magic; // JOURNAL_MAGIC
+    int epoch; // transactions of other epochs are dead
+    int stageList; // disk block of the first StageList of a staged checkpoint
+    int staged; // blocks it lists, 0 if there is none; no transactions follow
+} JournalHeader;
+
+// Staged checkpoint: pairs of a metadata block and the data block
+// holding its new contents, in a chain of list blocks
+#define STAGE_PAIRS_PER_BLOCK ((BLOCKSIZE - 2 * sizeof(int)) / (2 * sizeof(int)))
+
+typedef struct {
+    int next; // disk block of the next list block, -1 after the last
+    int count; // pairs used in this block
+    int pairs[STAGE_PAIRS_PER_BLOCK][2]; // disk block, disk block of its staged copy
+} StageList;
+
+typedef struct {
+    int magic; // JOURNAL_MAGIC
+    int epoch;
+    int seq; // 1 for the first transaction of the epoch
+    int blocks; // blocks the transaction takes, this header included
+    int bytes; // record bytes following this header
+    unsigned int crc; // crc32c of those bytes
+} JournalTxn;
+
+// A redo record; length bytes follow it. Lengths are multiples of 4,
+// so records stay aligned.
+typedef struct {
+    int block; // disk block
+    short offset;
+    short length;
+} JournalRecord;
+
+int syncCommit = 0; // VSFS_SYNC_COMMIT: operations commit before returning
+char *journalBuf = NULL; // pending records
+int journalLen = 0;
+int journalSpace = 0; // record bytes one transaction can hold
+int *journalIndex = NULL; // open addressing, 1 + offset of a pending record, 0 if empty
+int journalIndexSize = 0; // power of two
+char *journalTxnBuf = NULL; // the transaction being written
+int journalOps = 0; // operations between journal_begin and journal_end
+int journalGate = 0; // set by a commit to hold new operations back
+long long journalRound = 0; // commit rounds started
+long long journalDone = 0; // commit rounds finished
+long long journalFailedRound = 0; // last round that failed
+int journalEpoch = 0; // the fields from here on belong to the commit leader
+int journalSeq = 0; // of the next transaction
+int journalHead = 0; // block where the next transaction goes
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalGateCond = PTHREAD_COND_INITIALIZER; // operations drained or gate opened
+pthread_cond_t journalDoneCond = PTHREAD_COND_INITIALIZER; // a commit round finished
+
+// A paged table holds more dirty pages than its budget
+static int tables_pressure() {
+    return __atomic_load_n(&fatTable.pressure, __ATOMIC_RELAXED)
+           || (refBlocks > 0 && __atomic_load_n(&refTable.pressure, __ATOMIC_RELAXED))
+           || (sumBlocks > 0 && __atomic_load_n(&sumTable.pressure, __ATOMIC_RELAXED));
+}
+
+unsigned int crc32cTable[256];
+pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+int crc32cHardware = 0; // the CPU has the SSE4.2 crc32 instruction
+
+static void crc32c_init() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        crc32cTable[i] = c;
+    }
+#if defined(__x86_64__)
+    crc32cHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// Eight bytes per instruction; built for SSE4.2 whatever the compiler's
+// target, and only called once crc32c_init has found the instruction
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int c, const unsigned char *p, size_t n) {
+    uint64_t c64 = c;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c64 = __builtin_ia32_crc32di(c64, word);
+    }
+    c = (unsigned int) c64;
+    while (n-- > 0)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+// CRC-32C (Castagnoli) of the bytes before data, given as crc, and the
+// n bytes at data; 0 for no bytes before
+unsigned int crc32c_extend(unsigned int crc, const void *data, size_t n) {
+    pthread_once(&crc32cOnce, crc32c_init);
+    const unsigned char *p = (const unsigned char *) data;
+    unsigned int c = crc ^ 0xFFFFFFFF;
+#if defined(__x86_64__)
+    if (crc32cHardware)
+        return crc32c_sse42(c, p, n) ^ 0xFFFFFFFF;
+#endif
+    while (n-- > 0)
+        c = crc32cTable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+// CRC-32C (Castagnoli) of n bytes
+unsigned int crc32c(const void *data, size_t n) {
+    return crc32c_extend(0, data, n);
+}
+
+static unsigned int journal_hash(int block, int offset, int length) {
+    return ((unsigned int) block * 2654435761u ^ (unsigned int) offset * 40503u ^ (unsigned int) length)
+           & (journalIndexSize - 1);
+}
+
+// Log that length bytes at offset in disk block block now hold data.
+// Once the records no longer fit in a transaction they are dropped and
+// the next checkpoint stages the metadata blocks instead. A block must always be logged in the
+// same ranges: a record updated in place keeps its place in the log,
+// which would reorder it against a later record it overlaps.
+void journal_log(int block, int offset, const void *data, int length) {
+    if (!journalActive)
+        return;
+    pthread_mutex_lock(&journalLock);
+    if (journalOverflow) {
+        pthread_mutex_unlock(&journalLock);
+        return;
+    }
+    unsigned int h = journal_hash(block, offset, length);
+    while (journalIndex[h] != 0) {
+        JournalRecord *r = (JournalRecord *)(journalBuf + journalIndex[h] - 1);
+        if (r->block == block && r->offset == offset && r->length == length) {
+            memcpy(r + 1, data, length);
+            pthread_mutex_unlock(&journalLock);
+            return;
+        }
+        h = (h + 1) & (journalIndexSize - 1);
+    }
+    if (journalLen + (int) sizeof(JournalRecord) + length > journalSpace) {
+        journalOverflow = 1;
+        journalPressure = 1;
+    } else {
+        JournalRecord *r = (JournalRecord *)(journalBuf + journalLen);
+        r->block = block;
+        r->offset = (short) offset;
+        r->length = (short) length;
+        memcpy(r + 1, data, length);
+        journalIndex[h] = journalLen + 1;
+        journalLen += sizeof(JournalRecord) + length;
+    }
+    pthread_mutex_unlock(&journalLock);
+}
+
+// Drop the pending records. Called with journalLock held.
+static void journal_clear_pending() {
+    for (int pos = 0; pos < journalLen; ) {
+        JournalRecord *r = (JournalRecord *)(journalBuf + pos);
+        unsigned int h = journal_hash(r->block, r->offset, r->length);
+        while (journalIndex[h] != pos + 1)
+            h = (h + 1) & (journalIndexSize - 1);
+        journalIndex[h] = 0;
+        pos += sizeof(JournalRecord) + r->length;
+    }
+    journalLen = 0;
+}
+
+// Empty the journal by starting epoch epoch, with staged blocks listed
+// from stageList if staged is not 0
+static int journal_reset(int epoch, int stageList, int staged) {
+    char block[BLOCKSIZE];
+    memset(block, 0, BLOCKSIZE);
+    JournalHeader *h = (JournalHeader *) block;
+    h->magic = JOURNAL_MAGIC;
+    h->epoch = epoch;
+    h->stageList = stageList;
+    h->staged = staged;
+    if (disk_write_block(block, journalStart) < 0)
+        return -1;
+    STAT_ADD(syscalls, 1);
+    if (fsync(vs_fd) < 0)
+        return -1;
+    journalEpoch = epoch;
+    journalSeq = 1;
+    journalHead = journalStart + 1;
+    return 0;
+}
+
+// Write all metadata in place and empty the journal. Called by the
+// commit leader with the gate closed and no operation running.
+static int journal_checkpoint() {
+    int ret = 0;
+    if (tail_flush_all() < 0)
+        ret = -1;
+    if (cache_flush() < 0)
+        ret = -1;
+    if (extent_bufs_flush() < 0)
+        ret = -1;
+    if (table_flush(&fatTable) < 0)
+        ret = -1;
+    if (refBlocks > 0 && table_flush(&refTable) < 0)
+        ret = -1;
+    if (sumBlocks > 0 && table_flush(&sumTable) < 0)
+        ret = -1;
+    if (vs_map != NULL && map_flush() < 0)
+        ret = -1;
+    if (flush_metadata() < 0)
+        ret = -1;
+    STAT_ADD(syscalls, 1);
+    if (fsync(vs_fd) < 0)
+        ret = -1;
+    // The old transactions may be forgotten only once all of this is durable
+    if (ret == 0 && journal_reset(journalEpoch + 1, -1, 0) < 0)
+        ret = -1;
+    STAT_ADD(checkpoints, 1);
+    return ret;
+}
+
+// Copies of the dirty metadata blocks, collected by a staged checkpoint
+typedef struct {
+    int block; // disk block
+    char data[BLOCKSIZE];
+} StagedBlock;
+
+StagedBlock *stagedBlocks = NULL;
+int stagedCount = 0;
+int stagedCapacity = 0;
+
+static int stage_add(int block, const void *data) {
+    if (stagedCount == stagedCapacity) {
+        int capacity = stagedCapacity > 0 ? 2 * stagedCapacity : 64;
+        StagedBlock *grown = (StagedBlock *)realloc(stagedBlocks, capacity * sizeof(StagedBlock));
+        if (grown == NULL)
+            return -1;
+        stagedBlocks = grown;
+        stagedCapacity = capacity;
+    }
+    stagedBlocks[stagedCount].block = block;
+    memcpy(stagedBlocks[stagedCount].data, data, BLOCKSIZE);
+    stagedCount++;
+    return 0;
+}
+
+static int stage_table(PagedTable *t) {
+    int ret = 0;
+    if (t->pageCount == 0)
+        return 0;
+    pthread_mutex_lock(&t->lock);
+    for (int p = 0; ret == 0 && p < t->pageCount; p++) {
+        if (t->pages[p] != NULL && t->pages[p]->dirty)
+            ret = stage_add(t->startBlock + p, t->pages[p]->data);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+// Copy every metadata block that journal_checkpoint would write,
+// leaving it dirty. Called by the commit leader with the gate closed.
+static int stage_collect() {
+    stagedCount = 0;
+    if (stage_table(&fatTable) < 0 || stage_table(&refTable) < 0 || stage_table(&sumTable) < 0)
+        return -1;
+    for (int k = 0; k < dataStart; k++) {
+        if (metaDirty[k] && stage_add(k, metadata_block(k)) < 0)
+            return -1;
+    }
+    for (int i = 0; i < dirBlockCount - rootDirBlocks; i++) {
+        if (dirExtDirty[i] && stage_add(dirExtBlockNo[i] + dataStart, dirBlocks[rootDirBlocks + i]) < 0)
+            return -1;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&extentBufLock);
+    for (int h = 0; ret == 0 && h < EXTENT_BUF_BUCKETS; h++) {
+        for (ExtentBuf *e = extentBufs[h]; ret == 0 && e != NULL; e = e->next)
+            ret = stage_add(e->block + dataStart, &e->data);
+    }
+    pthread_mutex_unlock(&extentBufLock);
+    return ret;
+}
+
+// Give back blocks taken by stage_take
+static void stage_put(int *blocks, int count) {
+    pthread_mutex_lock(&allocLock);
+    for (int i = 0; i < count; i++) {
+        freeMap[blocks[i] / 64] |= (uint64_t) 1 << (blocks[i] % 64);
+        freeBlockCount++;
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+
+// Take count free data blocks into blocks, lowest first, without
+// marking them in the FAT, so they are free again after a crash.
+// Returns -1, taking none, if there are fewer.
+static int stage_take(int *blocks, int count) {
+    int got = 0;
+    pthread_mutex_lock(&allocLock);
+    for (int b = 0; b < dataBlocks && got < count; b++) {
+        if (b % FAT_ENTRIES_PER_BLOCK == 0)
+            free_map_fill(b / FAT_ENTRIES_PER_BLOCK);
+        if (b % 64 == 0 && freeMap[b / 64] == 0) {
+            b += 63;
+            continue;
+        }
+        if (is_block_free(b)) {
+            freeMap[b / 64] &= ~((uint64_t) 1 << (b % 64));
+            freeBlockCount--;
+            blocks[got++] = b;
+        }
+    }
+    pthread_mutex_unlock(&allocLock);
+    if (got == count)
+        return 0;
+    stage_put(blocks, got);
+    return -1;
+}
+
+// Checkpoint when not every change since the last one is in the
+// journal: write copies of the dirty metadata blocks to free data
+// blocks, start the next epoch with a header listing them, then
+// checkpoint as usual. A crash before the header replays the previous
+// epoch, after it the copies. Called like journal_checkpoint.
+static int journal_checkpoint_staged() {
+    if (tail_flush_all() < 0 || cache_flush() < 0 || stage_collect() < 0)
+        return -1;
+    int count = stagedCount;
+    if (count == 0)
+        return journal_checkpoint();
+    int listBlocks = (count + STAGE_PAIRS_PER_BLOCK - 1) / STAGE_PAIRS_PER_BLOCK;
+    int *at = (int *)malloc((count + listBlocks) * sizeof(int));
+    if (at == NULL)
+        return -1;
+    if (stage_take(at, count + listBlocks) < 0) {
+        // Refusing would keep every change since the last checkpoint
+        // from ever reaching the disk
+        vs_log(LOG_ERROR, "Error in journal checkpoint: No room to stage %d metadata blocks; "
+               "writing them in place unprotected\n", count);
+        free(at);
+        return journal_checkpoint();
+    }
+
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < count; i++)
+        ret = disk_write_block(stagedBlocks[i].data, at[i] + dataStart);
+    StageList list;
+    for (int j = 0; ret == 0 && j < listBlocks; j++) {
+        memset(&list, 0, sizeof(StageList));
+        list.next = j + 1 < listBlocks ? at[count + j + 1] + dataStart : -1;
+        for (int i = j * STAGE_PAIRS_PER_BLOCK; i < count && list.count < (int) STAGE_PAIRS_PER_BLOCK; i++) {
+            list.pairs[list.count][0] = stagedBlocks[i].block;
+            list.pairs[list.count][1] = at[i] + dataStart;
+            list.count++;
+        }
+        ret = disk_write_block(&list, at[count + j] + dataStart);
+    }
+    STAT_ADD(syscalls, 1);
+    if (ret == 0 && fsync(vs_fd) < 0)
+        ret = -1;
+    int listed = ret == 0;
+    if (listed && journal_reset(journalEpoch + 1, at[count] + dataStart, count) < 0)
+        ret = -1;
+    if (ret == 0)
+        ret = journal_checkpoint();
+
+    // Once a header may list the copies they must stay until another
+    // header replaces it, as a successful checkpoint does
+    if (ret == 0 || !listed)
+        stage_put(at, count + listBlocks);
+    free(at);
+    free(stagedBlocks);
+    stagedBlocks = NULL;
+    stagedCount = stagedCapacity = 0;
+    return ret;
+}
+
+// Write bytes of records, already in journalTxnBuf after the header,
+// as the next transaction and make it durable along with the data
+// written so far.
+static int journal_write_txn(int bytes, int blocks) {
+    // The sizes and checksums in the records cover bytes that may still
+    // be in tail buffers; they must be on disk when the records are
+    int ret = 0;
+    if (tail_flush_all() < 0)
+        ret = -1;
+    if (cache_flush() < 0)
+        ret = -1;
+    if (bytes > 0) {
+        JournalTxn *t = (JournalTxn *) journalTxnBuf;
+        t->magic = JOURNAL_MAGIC;
+        t->epoch = journalEpoch;
+        t->seq = journalSeq;
+        t->blocks = blocks;
+        t->bytes = bytes;
+        t->crc = crc32c(t + 1, bytes);
+        size_t len = (size_t) blocks * BLOCKSIZE;
+        memset(journalTxnBuf + sizeof(JournalTxn) + bytes, 0, len - sizeof(JournalTxn) - bytes);
+        STAT_ADD(blockWrites, blocks);
+        STAT_ADD(syscalls, 1);
+        if (pwrite(vs_fd, journalTxnBuf, len, (off_t) journalHead * BLOCKSIZE) != (ssize_t) len) {
+            vs_log(LOG_ERROR, "write error\n");
+            ret = -1;
+        }
+    }
+    STAT_ADD(syscalls, 1);
+    if (fsync(vs_fd) < 0)
+        ret = -1;
+    if (ret < 0) {
+        // The records are gone from memory; only a staged checkpoint saves them now
+        pthread_mutex_lock(&journalLock);
+        journalOverflow = 1;
+        journalPressure = 1;
+        pthread_mutex_unlock(&journalLock);
+        return -1;
+    }
+    if (bytes > 0) {
+        journalHead += blocks;
+        journalSeq++;
+    }
+    STAT_ADD(commits, 1);
+    return 0;
+}
+
+// One commit round, run by its leader: take the pending records once
+// no operation is halfway, then write them as a transaction, followed
+// by a checkpoint once the journal is half full or one is due. Records
+// that were dropped or do not fit get a staged checkpoint instead. The
+// blocks the round's deletes freed are reclaimed once it commits.
+static int journal_round() {
+    pthread_mutex_lock(&journalLock);
+    journalGate = 1;
+    while (journalOps > 0)
+        pthread_cond_wait(&journalGateCond, &journalLock);
+    int bytes = journalLen;
+    int blocks = (sizeof(JournalTxn) + bytes + BLOCKSIZE - 1) / BLOCKSIZE;
+    int staged = journalOverflow || journalHead + blocks > journalStart + journalBlocks;
+    int checkpoint = staged || journalPressure || tables_pressure()
+                     || journalHead + blocks > journalStart + journalBlocks / 2;
+    if (!staged)
+        memcpy(journalTxnBuf + sizeof(JournalTxn), journalBuf, bytes);
+    journal_clear_pending();
+    pthread_mutex_unlock(&journalLock);
+    // free_runs logs with allocLock held, so take it after journalLock
+    reclaim_hold();
+    if (!checkpoint) {
+        pthread_mutex_lock(&journalLock);
+        journalGate = 0;
+        pthread_cond_broadcast(&journalGateCond);
+        pthread_mutex_unlock(&journalLock);
+        int ret = journal_write_txn(bytes, blocks);
+        reclaim_settle(ret == 0);
+        return ret;
+    }
+
+    // Commit before writing in place. A mapped disk has had its
+    // metadata in place all along, so there is nothing to stage.
+    int ret = 0;
+    if (staged && vs_map == NULL) {
+        ret = journal_checkpoint_staged();
+    } else {
+        if (!staged && bytes > 0)
+            ret = journal_write_txn(bytes, blocks);
+        if (ret == 0)
+            ret = journal_checkpoint();
+    }
+    pthread_mutex_lock(&journalLock);
+    if (ret == 0) {
+        journalPressure = 0;
+        journalOverflow = 0;
+    }
+    journalGate = 0;
+    pthread_cond_broadcast(&journalGateCond);
+    pthread_mutex_unlock(&journalLock);
+    reclaim_settle(ret == 0);
+    return ret;
+}
+
+// Make every metadata change made before the call durable. Returns 0
+// on success, -1 on failure.
+int journal_commit() {
+    pthread_mutex_lock(&journalLock);
+    // A round already running may have taken the records before ours
+    long long target = journalRound + 1;
+    while (journalDone < target) {
+        if (journalRound == journalDone) {
+            journalRound++;
+            pthread_mutex_unlock(&journalLock);
+            int ret = journal_round();
+            pthread_mutex_lock(&journalLock);
+            if (ret < 0)
+                journalFailedRound = journalRound;
+            journalDone = journalRound;
+            pthread_cond_broadcast(&journalDoneCond);
+        } else {
+            pthread_cond_wait(&journalDoneCond, &journalLock);
+        }
+    }
+    int ret = journalFailedRound == target ? -1 : 0;
+    pthread_mutex_unlock(&journalLock);
+    return ret;
+}
+
+// Start an operation that changes metadata
+void journal_begin() {
+    if (!journalActive)
+        return;
+    pthread_mutex_lock(&journalLock);
+    while (journalGate)
+        pthread_cond_wait(&journalGateCond, &journalLock);
+    journalOps++;
+    pthread_mutex_unlock(&journalLock);
+}
+
+// End it, committing with VSFS_SYNC_COMMIT, when a checkpoint is due,
+// or once the pending records fill a quarter of the journal, so that
+// they still fit when the commit comes
+void journal_end() {
+    if (!journalActive)
+        return;
+    pthread_mutex_lock(&journalLock);
+    if (--journalOps == 0 && journalGate)
+        pthread_cond_broadcast(&journalGateCond);
+    int due = __atomic_load_n(&journalPressure, __ATOMIC_RELAXED) || journalLen > journalSpace / 4;
+    pthread_mutex_unlock(&journalLock);
+    if (syncCommit || due || tables_pressure()) {
+        if (journal_commit() < 0)
+            vs_log(LOG_ERROR, "Error in journal commit: Changes are not durable\n");
+    }
+}
+
+// Copy the staged blocks listed from disk block list to their places
+static int journal_unstage(int list, int staged) {
+    StageList l;
+    char block[BLOCKSIZE];
+    int done = 0;
+    while (done < staged) {
+        if (list < dataStart || list >= dataStart + dataBlocks || disk_read_block(&l, list) < 0
+            || l.count <= 0 || l.count > (int) STAGE_PAIRS_PER_BLOCK || done + l.count > staged) {
+            vs_log(LOG_ERROR, "Error in vsmount: Staged checkpoint list is damaged\n");
+            return -1;
+        }
+        for (int i = 0; i < l.count; i++) {
+            int to = l.pairs[i][0];
+            int from = l.pairs[i][1];
+            if (to < 0 || to >= dataStart + dataBlocks || from < dataStart || from >= dataStart + dataBlocks) {
+                vs_log(LOG_ERROR, "Error in vsmount: Staged checkpoint list is damaged\n");
+                return -1;
+            }
+            if (disk_read_block(block, from) < 0 || disk_write_block(block, to) < 0)
+                return -1;
+        }
+        done += l.count;
+        list = l.next;
+    }
+    STAT_ADD(syscalls, 1);
+    return fsync(vs_fd);
+}
+
+// Apply the committed transactions of the current epoch in place; new
+// transactions follow them. Called by vsmount before other metadata is
+// read. Returns the number replayed, or -1 if the journal is damaged.
+static int journal_replay() {
+    char *buf = (char *)malloc((size_t) journalBlocks * BLOCKSIZE);
+    if (buf == NULL || disk_read_blocks(buf, journalStart, journalBlocks) < 0) {
+        free(buf);
+        return -1;
+    }
+    JournalHeader *h = (JournalHeader *) buf;
+    if (h->magic != JOURNAL_MAGIC) {
+        vs_log(LOG_ERROR, "Error in vsmount: Journal header is damaged\n");
+        free(buf);
+        return -1;
+    }
+    journalEpoch = h->epoch;
+    journalSeq = 1;
+    journalHead = journalStart + 1;
+
+    // A staged checkpoint is the whole of its epoch. Its copies are in
+    // free blocks, so the header must stop listing them before they
+    // can be reused.
+    if (h->staged > 0) {
+        int ret = journal_unstage(h->stageList, h->staged);
+        if (ret == 0)
+            ret = journal_reset(journalEpoch + 1, -1, 0);
+        free(buf);
+        return ret < 0 ? -1 : 1;
+    }
+
+    int replayed = 0;
+    int ret = 0;
+    char block[BLOCKSIZE];
+    int current = -1; // disk block held in block
+    while (ret == 0 && journalHead < journalStart + journalBlocks) {
+        JournalTxn *t = (JournalTxn *)(buf + (size_t) (journalHead - journalStart) * BLOCKSIZE);
+        int room = journalStart + journalBlocks - journalHead;
+        if (t->magic != JOURNAL_MAGIC || t->epoch != journalEpoch || t->seq != journalSeq
+            || t->blocks < 1 || t->blocks > room || t->bytes < 0
+            || t->bytes > t->blocks * BLOCKSIZE - (int) sizeof(JournalTxn)
+            || crc32c(t + 1, t->bytes) != t->crc)
+            break; // past the last committed transaction
+
+        char *records = (char *)(t + 1);
+        for (int pos = 0; ret == 0 && pos < t->bytes; ) {
+            JournalRecord *r = (JournalRecord *)(records + pos);
+            pos += sizeof(JournalRecord);
+            if (r->block < 0 || r->block >= dataStart + dataBlocks || r->offset < 0 || r->length < 0
+                || r->offset + r->length > BLOCKSIZE || pos + r->length > t->bytes) {
+                vs_log(LOG_ERROR, "Error in vsmount: Journal record is damaged\n");
+                ret = -1;
+                break;
+            }
+            if (r->block != current) {
+                if (current != -1 && disk_write_block(block, current) < 0)
+                    ret = -1;
+                current = r->block;
+                if (disk_read_block(block, current) < 0)
+                    ret = -1;
+            }
+            memcpy(block + r->offset, records + pos, r->length);
+            pos += r->length;
+        }
+        replayed++;
+        journalSeq++;
+        journalHead += t->blocks;
+    }
+    if (ret == 0 && current != -1 && disk_write_block(block, current) < 0)
+        ret = -1;
+    free(buf);
+    return ret < 0 ? -1 : replayed;
+}
+
+// Replay the journal, if the disk has one, and reload the superblock
+// it may have changed. Called by vsmount once the layout is known.
+static int journal_recover() {
+    if (journalBlocks == 0)
+        return 0;
+    int replayed = journal_replay();
+    if (replayed <= 0)
+        return replayed;
+    vs_log(LOG_DEBUG, "VSMOUNT: REPLAYED %d JOURNAL TRANSACTIONS\n", replayed);
+    if (vs_map != NULL)
+        memcpy(&superblock, vs_map, BLOCKSIZE);
+    else if (disk_read_block(&superblock, 0) < 0)
+        return -1;
+    return layout_from_superblock();
+}
+
+// Turn logging on. Called by vsmount after journal_recover.
+static int journal_start() {
+    journalActive = 0;
+    if (journalBlocks == 0)
+        return 0;
+    journalSpace = (journalBlocks - 1) * BLOCKSIZE - sizeof(JournalTxn);
+    journalIndexSize = 1;
+    while (journalIndexSize < journalSpace / 6) // two slots per smallest record
+        journalIndexSize <<= 1;
+    journalBuf = (char *)malloc(journalSpace);
+    journalTxnBuf = (char *)malloc((size_t) (journalBlocks - 1) * BLOCKSIZE);
+    journalIndex = (int *)calloc(journalIndexSize, sizeof(int));
+    if (journalBuf == NULL || journalTxnBuf == NULL || journalIndex == NULL) {
+        vs_log(LOG_ERROR, "Error in vsmount: Could not allocate the journal buffers\n");
+        free(journalBuf);
+        free(journalTxnBuf);
+        free(journalIndex);
+        journalBuf = journalTxnBuf = NULL;
+        journalIndex = NULL;
+        return -1;
+    }
+    journalLen = 0;
+    journalPressure = 0;
+    journalOverflow = 0;
+    journalOps = 0;
+    journalGate = 0;
+    journalRound = journalDone = journalFailedRound = 0;
+    char *env = getenv("VSFS_SYNC_COMMIT");
+    syncCommit = env != NULL && atoi(env) != 0;
+    fatTable.pinDirty = vs_map == NULL;
+    refTable.pinDirty = vs_map == NULL;
+    sumTable.pinDirty = vs_map == NULL;
+    journalActive = 1;
+    return 0;
+}
+
+// Checkpoint, so the disk needs no replay, and turn logging off
+static int journal_stop() {
+    if (!journalActive)
+        return 0;
+    __atomic_store_n(&journalPressure, 1, __ATOMIC_RELAXED);
+    int ret = journal_commit();
+    journalActive = 0;
+    fatTable.pinDirty = 0;
+    refTable.pinDirty = 0;
+    sumTable.pinDirty = 0;
+    free(journalBuf);
+    free(journalTxnBuf);
+    free(journalIndex);
+    journalBuf = journalTxnBuf = NULL;
+    journalIndex = NULL;
+    return ret;
+}
+
+// Free what vsmount set up and close the disk, without writing
+// anything back. Undoes a mount that failed part way, or a mounted
+// disk once vsumount has synced it.
+static void mount_release() {
+    stats_stop();
+    cache_destroy();
+    table_destroy(&fatTable);
+    table_destroy(&refTable);
+    table_destroy(&sumTable);
+    for (int i = 0; i < openFileCount; i++){
+        if (fd_entry(i)->fd != -1) {
+            free(fd_entry(i)->skipIndex);
+            extent_map_free(&fd_entry(i)->extentMap);
+        }
+        fd_entry(i)->fd = -1;
+        pthread_rwlock_destroy(&fd_entry(i)->lock);
+        pthread_mutex_destroy(&fd_entry(i)->cursorLock);
+    }
+    for (int i = 0; i < openFileCount; i += FD_CHUNK)
+        free(openFileChunks[i / FD_CHUNK]);
+    openFileCount = 0;
+    fdFreeHead = -1;
+
+    for (int k = rootDirBlocks; vs_map == NULL && k < dirBlockCount; k++)
+        free(dirBlocks[k]);
+    free(dirBlocks);
+    free(dirExtBlockNo);
+    free(dirExtDirty);
+    dirBlocks = NULL;
+    dirExtBlockNo = NULL;
+    dirExtDirty = NULL;
+    dirBlockCount = 0;
+    dirLength = 0;
+
+    if (vs_map != NULL) {
+        munmap(vs_map, vs_mapSize);
+        vs_map = NULL;
+        free(mapDirty);
+        mapDirty = NULL;
+    } else {
+        free(rootDir);
+    }
+    rootDir = NULL;
+
+    close (vs_fd);
+    vs_fd = -1;
+}
+
+/**********************************************************************
+   The following functions are to be called by applications directly. 
+***********************************************************************/
+
+int vsformat (char *vdiskname, unsigned int m)
+{
+    return vsformatx(vdiskname, m, 0);
+}
+
+// Format with flags: FORMAT_EXTENTS maps files by extents,
+// FORMAT_CHECKSUMS keeps a checksum of every data block for vsfsck
+int vsformatx (char *vdiskname, unsigned int m, int flags)
+{
+    int64_t size;
+    int64_t num = 1;
+
+    if (flags & ~(FORMAT_EXTENTS | FORMAT_CHECKSUMS)) {
+        vs_log(LOG_ERROR, "Error in vsformat: Unknown flags %x\n", flags);
+        return -1;
+    }
+    if (m > 40) {
+        vs_log(LOG_ERROR, "Error in vsformat: Disk size 2^%u is too large\n", m);
+        return -1;
+    }
+    size  = num << m;
+    vs_log(LOG_DEBUG, "%u %lld", m, (long long) size);
+    if (layout_for_disk(size, flags) < 0) {
+        vs_log(LOG_ERROR, "Error in vsformat: Disk of %lld bytes cannot hold its metadata\n", (long long) size);
+        return -1;
+    }
+
+    vs_log(LOG_DEBUG, "OPENING VS_FD\n");
+    // Create the virtual disk at its full size. The data region is
+    // left as a hole, so no zeros are written for it.
+    vs_fd = open(vdiskname, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (vs_fd < 0 || ftruncate(vs_fd, (off_t) size) < 0) {
+        vs_log(LOG_ERROR, "Error in vsformat: Could not create %s\n", vdiskname);
+        if (vs_fd >= 0)
+            close(vs_fd);
+        return -1;
+    }
+
+    vs_log(LOG_DEBUG, "INITIALIZING SUPERBLOCK\n");
+    // Initialize superblock
+    memset(&superblock, 0, sizeof(SuperBlock));
+    superblock.blockSize = BLOCKSIZE;
+    superblock.fatSize = fatBlocks;
+    superblock.rootDirSize = rootDirBlocks;
+    superblock.diskSize = size > INT_MAX ? INT_MAX : (int) size;
+    superblock.magic = VSFS_MAGIC;
+    superblock.version = VSFS_VERSION;
+    superblock.diskBytes = size;
+    superblock.fatStart = fatStart;
+    superblock.rootDirStart = rootDirStart;
+    superblock.rootDirLength = rootDirLength;
+    superblock.dataStart = dataStart;
+    superblock.dataBlocks = dataBlocks;
+    superblock.flags = flags;
+    superblock.dirExtBlock = FAT_NO_NEXT;
+    superblock.journalStart = journalStart;
+    superblock.journalBlocks = journalBlocks;
+    superblock.refStart = refStart; // the table starts out as zeros, in the hole
+    superblock.refBlocks = refBlocks;
+    superblock.sumStart = sumStart; // likewise
+    superblock.sumBlocks = sumBlocks;
+    vs_log(LOG_DEBUG, "INITIALIZED SUPERBLOCK\n");
+    vs_log(LOG_DEBUG, "Size of SuperBlock: %lu bytes\n", sizeof(SuperBlock));    
+
+    // Initialize FAT table. It can be far larger than memory should
+    // hold, so it is written from one chunk of unallocated entries.
+    vs_log(LOG_DEBUG, "INITIALIZING FAT TABLE\n");
+    vs_log(LOG_DEBUG, "Size of FatEntry: %lu bytes\n", sizeof(FatEntry));    
+    size_t chunkEntries = (size_t) MAX_IO_SLICES * FAT_ENTRIES_PER_BLOCK;
+    FatEntry *chunk = (FatEntry *)malloc(chunkEntries * sizeof(FatEntry));
+    for (size_t i = 0; i < chunkEntries; i++) {
+        chunk[i].next = FAT_UNALLOCATED; // Mark all entries as unallocated
+    }
+    vs_log(LOG_DEBUG, "INITIALIZED FAT TABLE\n");
+
+    vs_log(LOG_DEBUG, "INITIALIZING ROOT DIRECTORY\n");
+    vs_log(LOG_DEBUG, "Size of directoryEntry: %lu bytes\n", sizeof(DirectoryEntry));    
+    // Initialize root directory
+    rootDir = (DirectoryEntry *)calloc(rootDirLength, sizeof(DirectoryEntry));
+    for (int i = 0; i < rootDirLength; i++) {
+        strcpy(rootDir[i].filename, "\0"); // Set filename to "\0" to mark as empty slot
+        rootDir[i].fileSize = 0;
+        rootDir[i].startBlock = FAT_UNALLOCATED;
+        rootDir[i].extentBlock = FAT_NO_NEXT;
+    }
+    vs_log(LOG_DEBUG, "INITIALIZED ROOT DIRECTORY\n");
+
+    vs_log(LOG_DEBUG, "WRITING METADATA\n");
+    // The metadata regions fill blocks 0 to dataStart - 1; every FAT
+    // block is the same chunk. The reference count table is left as a
+    // hole of zeros and the journal needs only its header.
+    int ret = 0;
+    if (pwrite(vs_fd, &superblock, BLOCKSIZE, 0) != BLOCKSIZE)
+        ret = -1;
+    for (int k = 0; ret == 0 && k < fatBlocks; k += MAX_IO_SLICES) {
+        int count = fatBlocks - k < MAX_IO_SLICES ? fatBlocks - k : MAX_IO_SLICES;
+        size_t len = (size_t) count * BLOCKSIZE;
+        if (pwrite(vs_fd, chunk, len, (off_t) (fatStart + k) * BLOCKSIZE) != (ssize_t) len)
+            ret = -1;
+    }
+    size_t dirLen = (size_t) rootDirBlocks * BLOCKSIZE;
+    if (ret == 0 && pwrite(vs_fd, rootDir, dirLen, (off_t) rootDirStart * BLOCKSIZE) != (ssize_t) dirLen)
+        ret = -1;
+    // An empty journal: epoch 1 with no transactions
+    char journalHeader[BLOCKSIZE];
+    memset(journalHeader, 0, BLOCKSIZE);
+    ((JournalHeader *) journalHeader)->magic = JOURNAL_MAGIC;
+    ((JournalHeader *) journalHeader)->epoch = 1;
+    if (ret == 0 && pwrite(vs_fd, journalHeader, BLOCKSIZE, (off_t) journalStart * BLOCKSIZE) != BLOCKSIZE)
+        ret = -1;
+    if (ret < 0)
+        vs_log(LOG_ERROR, "write error\n");
+    vs_log(LOG_DEBUG, "WROTE METADATA\n");
+
+    vs_log(LOG_DEBUG, "CLOSING VS_FD\n");
+    close(vs_fd);
+    free(chunk);
+    free(rootDir);
+    rootDir = NULL;
+
+    return (ret); 
+}
+
+
+int  vsmount (char *vdiskname)
+{
+    return vsmount_mode(vdiskname, MOUNT_BUFFERED);
+}
+
+// Mount with MOUNT_BUFFERED (block I/O through the cache) or MOUNT_MMAP
+// (the whole disk mapped into memory).
+int vsmount_mode (char *vdiskname, int mode)
+{
+    // open the Linux file vdiskname and in this
+    // way make it ready to be used for other operations.
+    // vs_fd is global; hence other function can use it. 
+    vs_fd = open(vdiskname, O_RDWR);
+    if (vs_fd < 0) {
+        vs_log(LOG_ERROR, "Error in vsmount: Could not open %s\n", vdiskname);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(vs_fd, &st) < 0) {
+        vs_log(LOG_ERROR, "Error in vsmount: Could not stat %s\n", vdiskname);
+        close(vs_fd);
+        return -1;
+    }
+
+    if (mode == MOUNT_MMAP) {
+        vs_mapSize = st.st_size;
+        vs_map = mmap(NULL, vs_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, vs_fd, 0);
+        if (vs_map == MAP_FAILED) {
+            vs_log(LOG_ERROR, "Error in vsmount: Could not map %s\n", vdiskname);
+            vs_map = NULL;
+            close(vs_fd);
+            return -1;
+        }
+        mapDirty = (char *)calloc(vs_mapSize / BLOCKSIZE, 1);
+        if (vs_mapSize < BLOCKSIZE) {
+            vs_log(LOG_ERROR, "Error in vsmount: %s is too small for a superblock\n", vdiskname);
+            mount_release();
+            return -1;
+        }
+        memcpy(&superblock, vs_map, BLOCKSIZE);
+    } else {
+        // load (chache) the superblock info from disk (Linux file) into memory
+        vs_log(LOG_DEBUG, "vs_fd has been opened: %d \n", vs_fd);
+        vs_log(LOG_DEBUG, "VSMOUNT: READING SUPERBLOCK \n");
+        if (read_block(&superblock, 0) < 0) {
+            mount_release();
+            return -1;
+        }
+    }
+
+    // A disk file shorter than its layout would fault on a mapped
+    // access past its end, and fail reads in the middle of a call
+    if (layout_from_superblock() < 0) {
+        mount_release();
+        return -1;
+    }
+    if ((int64_t) st.st_size < ((int64_t) dataStart + dataBlocks) * BLOCKSIZE) {
+        vs_log(LOG_ERROR, "Error in vsmount: %s is %lld bytes, shorter than its %d blocks\n",
+               vdiskname, (long long) st.st_size, dataStart + dataBlocks);
+        mount_release();
+        return -1;
+    }
+    if (journal_recover() < 0) {
+        mount_release();
+        return -1;
+    }
+    vs_log(LOG_DEBUG, "VSMOUNT: FINISHED READING SUPERBLOCK \n");
+
+    vs_log(LOG_DEBUG, "VSMOUNT: READING DIRECTORY \n");
+    if (vs_map != NULL) {
+        rootDir = (DirectoryEntry *)(vs_map + (size_t) rootDirStart * BLOCKSIZE);
+    } else {
+        // Read root directory
+        rootDir = (DirectoryEntry *)malloc((size_t) rootDirBlocks * BLOCKSIZE);
+        if (rootDir == NULL || disk_read_blocks(rootDir, rootDirStart, rootDirBlocks) < 0) {
+            vs_log(LOG_ERROR, "Error in vsmount: Could not read the root directory\n");
+            mount_release();
+            return -1;
+        }
+    }
+    vs_log(LOG_DEBUG, "VSMOUNT: FINISHED READING DIRECTORY \n");
+    free(metaDirty);
+    metaDirty = (char *)calloc(dataStart, 1);
+
+    // The FAT is read on demand, at most fatPages blocks at a time
+    int fatPages = DEFAULT_FAT_PAGES;
+    char *env = getenv("VSFS_FAT_PAGES");
+    if (env != NULL)
+        fatPages = atoi(env);
+    if (table_init(&fatTable, fatStart, fatBlocks, fatPages) < 0
+        || (refBlocks > 0 && table_init(&refTable, refStart, refBlocks, fatPages) < 0)
+        || (sumBlocks > 0 && table_init(&sumTable, sumStart, sumBlocks, fatPages) < 0)) {
+        mount_release();
+        return -1;
+    }
+    build_free_map();
+    if (dir_load() < 0) {
+        mount_release();
+        return -1;
+    }
+
+    // Metadata is loaded above or paged in by fatTable and written
+    // back directly, so the block cache only ever holds data blocks. A mapped disk
+    // needs no cache at all.
+    int cacheBlocks = DEFAULT_CACHE_SIZE_IN_BLOCKS;
+    env = getenv("VSFS_CACHE_BLOCKS");
+    if (env != NULL)
+        cacheBlocks = atoi(env);
+    if (cache_init(vs_map != NULL ? 0 : cacheBlocks) < 0) {
+        mount_release();
+        return -1;
+    }
+
+    // A readahead window larger than the cache would evict itself
+    readaheadBlocks = DEFAULT_READAHEAD_BLOCKS;
+    env = getenv("VSFS_READAHEAD_BLOCKS");
+    if (env != NULL)
+        readaheadBlocks = atoi(env);
+    if (vs_map == NULL && readaheadBlocks > cacheSize / 2)
+        readaheadBlocks = cacheSize / 2;
+
+    stats_start();
+
+    // Tail buffer flush policy; any limit reached writes the block
+    tailFlushBytes = DEFAULT_TAIL_FLUSH_BYTES;
+    tailFlushCount = DEFAULT_TAIL_FLUSH_COUNT;
+    tailFlushMs = DEFAULT_TAIL_FLUSH_MS;
+    if ((env = getenv("VSFS_TAIL_FLUSH_BYTES")) != NULL)
+        tailFlushBytes = atoi(env);
+    if ((env = getenv("VSFS_TAIL_FLUSH_COUNT")) != NULL)
+        tailFlushCount = atoi(env);
+    if ((env = getenv("VSFS_TAIL_FLUSH_MS")) != NULL)
+        tailFlushMs = atoi(env);
+
+    // Freed blocks are punched out of the host file by every vsdelete,
+    // or with VSFS_DEFER_RECLAIM at the next vssync. Blocks the journal
+    // has committed to a file wait for the delete to commit as well.
+    env = getenv("VSFS_DEFER_RECLAIM");
+    deferReclaim = env != NULL && atoi(env) != 0;
+
+    if (journal_start() < 0) {
+        mount_release();
+        return -1;
+    }
+    
+    return(0);
+}
+
+
+int vsumount ()
+{
+    // Finish queued asynchronous requests, then write back dirty data
+    // blocks and only the metadata blocks that changed since the last
+    // sync. A checkpoint leaves the journal empty. The mount is
+    // released even if that fails, and the failure returned.
+    async_shutdown();
+    int ret = 0;
+    if (vssync() < 0)
+        ret = -1;
+    if (journal_stop() < 0)
+        ret = -1;
+    mount_release();
+    return ret;
+}
+
+// Make all changes durable: buffered tails and dirty data blocks first, then dirty
+// metadata blocks, then fsync. With a journal the metadata is committed
+// to it instead, which also punches the blocks of the deletes it commits.
+// With VSFS_DEFER_RECLAIM the other freed blocks are punched last.
+// Returns 0 on success, -1 on failure.
+int vssync()
+{
+    long long start = stats_begin();
+    int ret = 0;
+    if (tail_flush_all() < 0)
+        ret = -1;
+    if (cache_flush() < 0)
+        ret = -1;
+    if (journalActive) {
+        if (vs_map != NULL && map_flush() < 0)
+            ret = -1;
+        if (journal_commit() < 0)
+            ret = -1;
+    } else {
+        if (table_flush(&fatTable) < 0)
+            ret = -1;
+        if (refBlocks > 0 && table_flush(&refTable) < 0)
+            ret = -1;
+        if (sumBlocks > 0 && table_flush(&sumTable) < 0)
+            ret = -1;
+        if (vs_map != NULL && map_flush() < 0)
+            ret = -1;
+        if (flush_metadata() < 0)
+            ret = -1;
+        STAT_ADD(syscalls, 1);
+        if (fsync (vs_fd) < 0) // synchronize kernel file cache with the disk
+            ret = -1;
+    }
+    // Deletes are durable now, so their blocks may lose their contents
+    if (ret == 0 && deferReclaim)
+        reclaim_blocks();
+    stats_end(VSOP_SYNC, start, 0);
+    return ret;
+}
+
+static int create_file(char *filename)
+{
+    // Names are unique; the directory index maps each to one slot
+    if (find_file_by_name(filename) != -1) {
+        vs_log(LOG_ERROR, "Error in vscreate: File already exists\n");
+        return -1;
+    }
+
+    // Take a free slot, adding a directory block if there is none
+    if (dirFreeCount == 0 && dir_grow() < 0) {
+        vs_log(LOG_ERROR, "Error in vscreate: No empty slots in the root directory");
+        return -1; // No available slot in the root directory
+    }
+    int emptySlot = dirFreeSlots[--dirFreeCount];
+
+    // Create a new directory entry for the file
+    DirectoryEntry newFile;
+    memset(&newFile, 0, sizeof(DirectoryEntry));
+    snprintf(newFile.filename, MAX_FILENAME_LENGTH, "%s", filename);
+    newFile.fileSize = 0;
+    newFile.extentBlock = FAT_NO_NEXT;
+
+    // The file starts out inline; vsappend gives it a data block once
+    // it outgrows the directory entry
+    newFile.startBlock = FAT_INLINE;
+
+    // Insert the new directory entry into the root directory
+    *dir_entry(emptySlot) = newFile;
+    dir_index_insert(emptySlot);
+    dir_mark_dirty(emptySlot);
+    
+    return (0);
+}
+
+
+int vscreate(char *filename)
+{
+    long long start = stats_begin();
+    journal_begin();
+    pthread_rwlock_wrlock(&dirLock);
+    int ret = create_file(filename);
+    pthread_rwlock_unlock(&dirLock);
+    journal_end();
+    stats_end(VSOP_CREATE, start, 0);
+    return ret;
+}
+
+static int open_file(char *filename, int mode)
+{
+    // Search for the file in the root directory
+    int fileIndex = find_file_by_name(filename);
+
+    // If the file is not found, return an error
+    if (fileIndex == -1) {
+        vs_log(LOG_ERROR, "Error in vsopen: File not found\n");
+        return -1;
+    }
+
+    // Check if the file is already open in the specified mode
+    int openFd = dirOpenFd[fileIndex];
+    if (openFd != -1) {
+        if (fd_entry(openFd)->mode == mode) {
+            vs_log(LOG_ERROR, "vsopen warning: File is already open in the specified mode.\nReturning existing file descriptor.\n");
+            return openFd;
+        } else {
+            vs_log(LOG_ERROR, "vsopen warning: File is already open in a different mode.\nReturning existing file descriptor.\n");
+            return -1;
+        }
+    }
+
+    // Take an entry off the free list, growing the table if it is empty
+    if (fdFreeHead == -1 && fd_table_grow() < 0) {
+        vs_log(LOG_ERROR, "Error in vsopen: Could not find available space for opening the file\n");
+        return -1;
+    }
+
+    if (mode != MODE_READ && mode != MODE_APPEND) {
+        vs_log(LOG_ERROR, "Error in vsopen: Invalid access mode\n");
+        return -1;
+    }
+
+    // Initialize the open file table entry
+    int openFileIndex = fdFreeHead;
+    OpenFileEntry *entry = fd_entry(openFileIndex);
+    snprintf(entry->filename, MAX_FILENAME_LENGTH, "%s", filename);
+    entry->mode = mode;
+    entry->dirIndex = fileIndex;
+
+    memset(&entry->extentMap, 0, sizeof(ExtentMap));
+    if (extentMode && extent_map_load(&entry->extentMap, fileIndex) < 0) {
+        extent_map_free(&entry->extentMap);
+        vs_log(LOG_ERROR, "Error in vsopen: Could not read the extent list\n");
+        return -1;
+    }
+
+    if (mode == MODE_APPEND && dir_entry(fileIndex)->startBlock == FAT_INLINE) {
+        entry->tailBlock = FAT_INLINE;
+        entry->tailOffset = dir_entry(fileIndex)->fileSize;
+    } else if (mode == MODE_APPEND && extentMode) {
+        // The tail is the block holding the last byte
+        int size = dir_entry(fileIndex)->fileSize;
+        int tailIndex = size > 0 ? (size - 1) / BLOCKSIZE : 0;
+        entry->tailBlock = extent_block_at(&entry->extentMap, tailIndex);
+        entry->tailOffset = size - tailIndex * BLOCKSIZE;
+    } else if (mode == MODE_APPEND) {
+        // Walk the chain once to find where appends continue
+        int blockCount = 1;
+        entry->tailBlock = dir_entry(fileIndex)->startBlock;
+        for (int next = fat_get(entry->tailBlock); next != FAT_NO_NEXT; next = fat_get(next)) {
+            entry->tailBlock = next;
+            blockCount++;
+        }
+        entry->tailOffset = dir_entry(fileIndex)->fileSize - (blockCount - 1) * BLOCKSIZE;
+    }
+    entry->tailLoaded = 0;
+    entry->tailPending = 0;
+    entry->tailAppends = 0;
+    entry->readOffset = 0;
+    entry->readBlock = dir_entry(fileIndex)->startBlock;
+    entry->readaheadEnd = 0;
+    entry->skipIndex = NULL;
+    entry->skipCapacity = 0;
+    if (skip_reset(entry) < 0) {
+        extent_map_free(&entry->extentMap);
+        vs_log(LOG_ERROR, "Error in vsopen: Out of memory\n");
+        return -1;
+    }
+    fdFreeHead = entry->nextFree;
+    dirOpenFd[fileIndex] = openFileIndex;
+    entry->fd = openFileIndex;
+
+    // Return the index of the opened file in the openfile table
+    return openFileIndex;
+}
+
+int vsopen(char *filename, int mode)
+{
+    long long start = stats_begin();
+    pthread_rwlock_wrlock(&dirLock);
+    int ret = open_file(filename, mode);
+    pthread_rwlock_unlock(&dirLock);
+    stats_end(VSOP_OPEN, start, 0);
+    return ret;
+}
+
+// Returns 0 on success, -1 on failure
+int vsclose(int fd){
+
+    long long start = stats_begin();
+    // Let queued asynchronous requests on the descriptor finish first
+    if (checkFdValidity(fd) >= 0)
+        async_drain(fd);
+
+    pthread_rwlock_wrlock(&dirLock);
+    if (checkFdValidity(fd) < 0){
+        pthread_rwlock_unlock(&dirLock);
+        vs_log(LOG_ERROR, "Error in vsclose: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    // Wait for calls still using the descriptor, write its buffered
+    // tail, then mark the entry free
+    pthread_rwlock_wrlock(&fd_entry(fd)->lock);
+    int ret = tail_flush(fd_entry(fd));
+    fd_entry(fd)->fd = -1;
+    fd_entry(fd)->mode = -1; // Reset mode
+    dirOpenFd[fd_entry(fd)->dirIndex] = -1;
+    fd_entry(fd)->nextFree = fdFreeHead;
+    fdFreeHead = fd;
+    free(fd_entry(fd)->skipIndex);
+    fd_entry(fd)->skipIndex = NULL;
+    extent_map_free(&fd_entry(fd)->extentMap);
+    pthread_rwlock_unlock(&fd_entry(fd)->lock);
+    pthread_rwlock_unlock(&dirLock);
+
+    // Write back the blocks this file dirtied in the cache
+    if (cache_flush() < 0)
+        ret = -1;
+    stats_end(VSOP_CLOSE, start, 0);
+    return ret;
+}
+
+int vssize (int  fd)
+{
+    if (checkFdValidity(fd) < 0){
+        vs_log(LOG_ERROR, "Error in vssize: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    // Use the open file table to get the file size
+    pthread_rwlock_rdlock(&fd_entry(fd)->lock);
+    int size = dir_entry(fd_entry(fd)->dirIndex)->fileSize;
+    pthread_rwlock_unlock(&fd_entry(fd)->lock);
+    return size;
+
+}
+
+// Prefetch readaheadBlocks blocks of the chain starting at block,
+// which is the file's index-th block, so that a sequential reader
+// finds them cached. Called with the cursor lock held.
+static void read_ahead(OpenFileEntry *entry, int block, int index) {
+    int blocks[readaheadBlocks];
+    int count = 0;
+    // Extent-mode files may own preallocated blocks past their end
+    int fileBlocks = (int) (((int64_t) dir_entry(entry->dirIndex)->fileSize + BLOCKSIZE - 1) / BLOCKSIZE);
+    while (count < readaheadBlocks && index + count < fileBlocks && block != FAT_NO_NEXT) {
+        blocks[count++] = block + dataStart;
+        block = file_next_block(entry, block);
+    }
+    if (vs_map != NULL)
+        map_prefetch(blocks, count);
+    else
+        cache_prefetch(blocks, count);
+    entry->readaheadEnd = index + count;
+}
+
+// Whether the current contents of block are in entry's tail buffer
+static int tail_buffered(OpenFileEntry *entry, int block) {
+    return entry->tailPending > 0 && block == entry->tailBlock;
+}
+
+// Copy n bytes of a file into the iovecs, starting offset bytes into
+// block and following the chain (or extents) from there.
+static int read_chain(OpenFileEntry *entry, int block, int offset, IovCursor *c, int n) {
+    // Bytes claimed while the file was inline are in its first block
+    // if an append has moved them there since
+    if (block == FAT_INLINE) {
+        DirectoryEntry *file = dir_entry(entry->dirIndex);
+        if (file->startBlock == FAT_INLINE) {
+            iov_scatter(c, file->inlineData + offset, n);
+            return n;
+        }
+        block = file->startBlock;
+    }
+
+    // Initialize variables to keep track of the number of bytes read
+    int bytesRead = 0;
+
+    // Continue reading until all requested bytes are read or we reach the end of the file
+    while (bytesRead < n && block != FAT_NO_NEXT) {
+        int want = n - bytesRead;
+
+        // Whole uncached blocks that follow each other on disk are read
+        // straight into the caller's buffers with one preadv
+        if (offset == 0 && want >= BLOCKSIZE && vs_map == NULL
+            && !cache_contains(block + dataStart) && !tail_buffered(entry, block)) {
+            int last = block;
+            int runBlocks = 1;
+            while ((runBlocks + 1) * BLOCKSIZE <= want && file_next_block(entry, last) == last + 1
+                   && !cache_contains(last + 1 + dataStart) && !tail_buffered(entry, last + 1)) {
+                last++;
+                runBlocks++;
+            }
+            if (disk_transfer_v(c, block + dataStart, (size_t) runBlocks * BLOCKSIZE, 0) < 0)
+                break;
+            bytesRead += runBlocks * BLOCKSIZE;
+            block = file_next_block(entry, last);
+            continue;
+        }
+
+        // Allocate a buffer to store the data block read from the virtual disk
+        char dataBlock[BLOCKSIZE];
+
+        // Read the data block from the virtual disk, or use it in place
+        char *data = mapped_block(block + dataStart);
+        if (tail_buffered(entry, block)) {
+            data = entry->tailBuf;
+        } else if (data == NULL) {
+            if (read_block(dataBlock, block + dataStart) < 0)
+                break;
+            data = dataBlock;
+        }
+
+        // Calculate the number of bytes to copy from the data block to the buffer
+        int spaceInBlock = BLOCKSIZE - offset;
+        int bytesToCopy = want < spaceInBlock ? want : spaceInBlock;
+
+        // Copy data from the data block to the buffer
+        iov_scatter(c, data + offset, bytesToCopy);
+
+        // Update counters
+        bytesRead += bytesToCopy;
+        offset = 0;
+
+        // Move to the next block in the FAT table
+        block = file_next_block(entry, block);
+    }
+
+    return bytesRead;
+}
+
+// Reserve the next n bytes at the read cursor of entry and move the
+// cursor past them. Returns the number of bytes reserved and where
+// they start.
+static int claim_read(OpenFileEntry *entry, int n, int *startBlock, int *startOffset) {
+    DirectoryEntry *file = dir_entry(entry->dirIndex);
+
+    // Claim the next n bytes and move the cursor past them while holding
+    // the cursor lock; the copy itself runs without it, so threads
+    // sharing this descriptor copy in parallel.
+    pthread_mutex_lock(&entry->cursorLock);
+
+    // Never read past the end of the file
+    int remaining = file->fileSize - entry->readOffset;
+    if (n > remaining)
+        n = remaining;
+    if (n < 0)
+        n = 0;
+
+    // A read that ended on a block boundary at the end of the file left
+    // the cursor past the chain; appends since then have extended it
+    if (entry->readBlock == FAT_NO_NEXT && n > 0)
+        entry->readBlock = locate_block(entry, entry->readOffset / BLOCKSIZE);
+
+    *startBlock = entry->readBlock;
+    *startOffset = entry->readOffset;
+    int end = *startOffset + n;
+    if (*startBlock == FAT_INLINE) {
+        entry->readOffset = end;
+        pthread_mutex_unlock(&entry->cursorLock);
+        return n;
+    }
+    int index = *startOffset / BLOCKSIZE;
+    int block = *startBlock;
+    while (block != FAT_NO_NEXT && index * BLOCKSIZE < end) {
+        // Entering a block outside the prefetched window starts the next one
+        if (index >= entry->readaheadEnd && readaheadBlocks > 1)
+            read_ahead(entry, block, index);
+        if ((index + 1) * BLOCKSIZE > end)
+            break;
+        block = file_next_block(entry, block);
+        index++;
+        skip_note(entry, index, block);
+    }
+    entry->readOffset = end;
+    entry->readBlock = block;
+    pthread_mutex_unlock(&entry->cursorLock);
+    return n;
+}
+
+int vsreadv(int fd, const struct iovec *iov, int iovcnt) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0 || iovcnt < 0) {
+        vs_log(LOG_ERROR, "Error in vsreadv: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    long long start = stats_begin();
+    OpenFileEntry *entry = fd_entry(fd);
+    pthread_rwlock_rdlock(&entry->lock);
+    int startBlock, startOffset;
+    int n = claim_read(entry, iov_total(iov, iovcnt), &startBlock, &startOffset);
+
+    IovCursor c;
+    iov_init(&c, iov, iovcnt);
+    int bytesRead = read_chain(entry, startBlock, startOffset % BLOCKSIZE, &c, n);
+    pthread_rwlock_unlock(&entry->lock);
+    stats_end(VSOP_READ, start, bytesRead);
+    return bytesRead;
+}
+
+int vsread(int fd, void *buf, int n) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0) {
+        vs_log(LOG_ERROR, "Error in vsread: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = n > 0 ? n : 0;
+    return vsreadv(fd, &iov, 1);
+}
+
+// Read up to n bytes starting at file offset offset, without using or
+// moving the read cursor.
+int vspread(int fd, void *buf, int n, int offset) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0 || offset < 0) {
+        vs_log(LOG_ERROR, "Error in vspread: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    long long start = stats_begin();
+    OpenFileEntry *entry = fd_entry(fd);
+    pthread_rwlock_rdlock(&entry->lock);
+
+    // Never read past the end of the file
+    int remaining = dir_entry(entry->dirIndex)->fileSize - offset;
+    if (n > remaining)
+        n = remaining;
+    int bytesRead = 0;
+    if (n > 0) {
+        pthread_mutex_lock(&entry->cursorLock);
+        int block = locate_block(entry, offset / BLOCKSIZE);
+        pthread_mutex_unlock(&entry->cursorLock);
+
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        IovCursor c;
+        iov_init(&c, &iov, 1);
+        bytesRead = read_chain(entry, block, offset % BLOCKSIZE, &c, n);
+    }
+    pthread_rwlock_unlock(&entry->lock);
+    stats_end(VSOP_READ, start, bytesRead);
+    return bytesRead;
+}
+
+// Move the read cursor to file offset offset (at most the file size).
+// Returns the new offset.
+int vsseek(int fd, int offset) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0 || offset < 0) {
+        vs_log(LOG_ERROR, "Error in vsseek: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    OpenFileEntry *entry = fd_entry(fd);
+    pthread_rwlock_rdlock(&entry->lock);
+    if (offset > dir_entry(entry->dirIndex)->fileSize)
+        offset = dir_entry(entry->dirIndex)->fileSize;
+
+    pthread_mutex_lock(&entry->cursorLock);
+    entry->readOffset = offset;
+    entry->readBlock = locate_block(entry, offset / BLOCKSIZE);
+    // Readahead resumes only if reading continues into the next block
+    entry->readaheadEnd = offset / BLOCKSIZE + 1;
+    pthread_mutex_unlock(&entry->cursorLock);
+
+    pthread_rwlock_unlock(&entry->lock);
+    return offset;
+}
+
+// Move the append position of entry to a fresh block after its tail.
+// In extent mode that is the next preallocated block if there is one;
+// otherwise a run is reserved, as long as the file so far (at most
+// MAX_PREALLOC_BLOCKS) but no shorter than wantBlocks. Returns the
+// block, or -1 when the disk is full.
+static int advance_tail(OpenFileEntry *entry, int wantBlocks) {
+    int block;
+    if (!extentMode) {
+        block = find_free_block(entry->tailBlock + 1);
+        if (block == -1)
+            return -1;
+        fat_set(entry->tailBlock, block);
+    } else {
+        ExtentMap *map = &entry->extentMap;
+        block = extent_next(map, entry->tailBlock);
+        if (block == FAT_NO_NEXT) {
+            int want = map->blocks < MAX_PREALLOC_BLOCKS ? map->blocks : MAX_PREALLOC_BLOCKS;
+            if (want < wantBlocks)
+                want = wantBlocks;
+            int count;
+            block = find_free_run(entry->tailBlock + 1, want, &count);
+            if (block == -1)
+                return -1;
+            int oldCount = map->count;
+            int from = extent_map_add(map, block, count);
+            if (from < 0 || extent_map_store(map, entry->dirIndex, from) < 0) {
+                // Undo, so the map matches what is on disk
+                if (from >= 0) {
+                    map->blocks -= count;
+                    if (map->count > oldCount)
+                        map->count = oldCount;
+                    else
+                        map->extents[from].length -= count;
+                }
+                for (int i = 0; i < count; i++)
+                    release_block(block + i);
+                return -1;
+            }
+        }
+    }
+    entry->tailBlock = block;
+    entry->tailOffset = 0;
+    entry->tailLoaded = 0;
+    return block;
+}
+
+// Give an inline file its first data block (a run of up to wantBlocks
+// in extent mode) and move its contents there, into the tail buffer
+// unless the disk is mapped. Called with the open file's lock held for
+// writing. Returns -1 when the disk is full.
+static int spill_inline(OpenFileEntry *entry, int wantBlocks) {
+    DirectoryEntry *file = dir_entry(entry->dirIndex);
+    char data[INLINE_DATA_SIZE];
+    memcpy(data, file->inlineData, file->fileSize);
+
+    int count = 1;
+    int block = extentMode ? find_free_run(-1, wantBlocks, &count) : find_free_block(-1);
+    if (block == -1)
+        return -1;
+    if (extentMode) {
+        // The extents overwrite the inline data, which is copied above
+        ExtentMap *map = &entry->extentMap;
+        memset(file->extents, 0, sizeof(file->extents));
+        if (extent_map_add(map, block, count) < 0 || extent_map_store(map, entry->dirIndex, 0) < 0) {
+            extent_map_free(map);
+            memcpy(file->inlineData, data, file->fileSize);
+            file->extentCount = 0;
+            for (int i = 0; i < count; i++)
+                release_block(block + i);
+            return -1;
+        }
+    }
+
+    char *mapped = mapped_block(block + dataStart);
+    if (mapped != NULL) {
+        memcpy(mapped, data, file->fileSize);
+        __atomic_store_n(&mapDirty[block + dataStart], 1, __ATOMIC_RELEASE);
+    } else {
+        memcpy(entry->tailBuf, data, file->fileSize);
+        memset(entry->tailBuf + file->fileSize, 0, BLOCKSIZE - file->fileSize);
+        entry->tailLoaded = 1;
+        entry->tailPending = file->fileSize;
+        entry->tailSince = now_ms();
+    }
+    sum_append(block, 0, data, file->fileSize);
+    entry->tailBlock = block;
+    entry->tailOffset = file->fileSize;
+    file->startBlock = block;
+    dir_mark_dirty(entry->dirIndex);
+
+    // A read cursor inside the inline bytes now points into the block
+    pthread_mutex_lock(&entry->cursorLock);
+    if (entry->readBlock == FAT_INLINE)
+        entry->readBlock = block;
+    pthread_mutex_unlock(&entry->cursorLock);
+    return 0;
+}
+
+int vsappendv(int fd, const struct iovec *iov, int iovcnt) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0 || iovcnt < 0) {
+        vs_log(LOG_ERROR, "Error in vsappendv: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+    if (fd_entry(fd)->mode != MODE_APPEND) {
+        vs_log(LOG_ERROR, "Error in vsappendv: The file is not open for appending\n");
+        return -1;
+    }
+
+    long long start = stats_begin();
+    OpenFileEntry *entry = fd_entry(fd);
+    journal_begin();
+    pthread_rwlock_wrlock(&entry->lock);
+    DirectoryEntry *file = dir_entry(entry->dirIndex);
+    IovCursor c;
+    iov_init(&c, iov, iovcnt);
+    int n = iov_total(iov, iovcnt);
+
+    // File sizes are ints
+    if (n > INT_MAX - file->fileSize) {
+        vs_log(LOG_ERROR, "Error in vsappend: The file would grow past the largest file size\n");
+        pthread_rwlock_unlock(&entry->lock);
+        journal_end();
+        stats_end(VSOP_APPEND, start, 0);
+        return -1;
+    }
+
+    // Small files stay in the directory entry: no block I/O at all
+    if (file->startBlock == FAT_INLINE) {
+        if (n <= (int) INLINE_DATA_SIZE - file->fileSize) {
+            iov_gather(&c, file->inlineData + file->fileSize, n);
+            file->fileSize += n;
+            entry->tailOffset = file->fileSize;
+            dir_mark_dirty(entry->dirIndex);
+            pthread_rwlock_unlock(&entry->lock);
+            journal_end();
+            stats_end(VSOP_APPEND, start, n);
+            return n;
+        }
+        if (spill_inline(entry, (int) (((int64_t) file->fileSize + n + BLOCKSIZE - 1) / BLOCKSIZE)) < 0) {
+            vs_log(LOG_ERROR, "Error in vsappend: No free blocks available in the FAT table\n");
+            pthread_rwlock_unlock(&entry->lock);
+            journal_end();
+            stats_end(VSOP_APPEND, start, 0);
+            return 0;
+        }
+    }
+    skip_reset(entry); // cannot fail: vsopen allocated the index
+
+    int bytesWritten = 0;
+    while (bytesWritten < n) {
+        // Continue in a new block once the tail block is full
+        int want = n - bytesWritten;
+        if (entry->tailOffset == BLOCKSIZE) {
+            if (tail_flush(entry) < 0)
+                break;
+            if (advance_tail(entry, (int) (((int64_t) want + BLOCKSIZE - 1) / BLOCKSIZE)) == -1) {
+                vs_log(LOG_ERROR, "Error in vsappend: No free blocks available in the FAT table\n");
+                break;
+            }
+        }
+
+        // An empty tail followed by whole blocks of input: extend the
+        // chain while the allocator returns consecutive blocks and
+        // write the run straight from the caller's buffers
+        if (entry->tailOffset == 0 && want >= BLOCKSIZE && vs_map == NULL) {
+            int runStart = entry->tailBlock;
+            int runBlocks = 1;
+            int emptyTail = 0; // a block allocated past the run is now the tail
+            while (runBlocks < want / BLOCKSIZE) {
+                int newBlock = advance_tail(entry, want / BLOCKSIZE - runBlocks);
+                if (newBlock == -1)
+                    break;
+                if (newBlock != runStart + runBlocks) {
+                    emptyTail = 1;
+                    break;
+                }
+                runBlocks++;
+            }
+            for (int i = 0; i < runBlocks; i++)
+                cache_discard(runStart + i + dataStart);
+            sum_iov_blocks(c, runStart, runBlocks);
+            if (disk_transfer_v(&c, runStart + dataStart, (size_t) runBlocks * BLOCKSIZE, 1) < 0)
+                break;
+
+            bytesWritten += runBlocks * BLOCKSIZE;
+            entry->tailOffset = emptyTail ? 0 : BLOCKSIZE;
+            entry->tailLoaded = 0;
+            file->fileSize += runBlocks * BLOCKSIZE;
+            dir_mark_dirty(entry->dirIndex);
+            continue;
+        }
+
+        int spaceInBlock = BLOCKSIZE - entry->tailOffset;
+        int bytesToWrite = want < spaceInBlock ? want : spaceInBlock;
+
+        // A tail block shared with a clone is copied before it changes
+        if (entry->tailOffset > 0 && tail_unshare(entry) < 0)
+            break;
+
+        // Merge with the bytes already in the tail block
+        char *data = mapped_block(entry->tailBlock + dataStart);
+        if (data != NULL) {
+            iov_gather(&c, data + entry->tailOffset, bytesToWrite);
+            __atomic_store_n(&mapDirty[entry->tailBlock + dataStart], 1, __ATOMIC_RELEASE);
+        } else {
+            // Collect in the tail buffer; the block is written once full
+            if (tail_load(entry) < 0)
+                break;
+            data = entry->tailBuf;
+            iov_gather(&c, data + entry->tailOffset, bytesToWrite);
+            if (entry->tailPending == 0)
+                entry->tailSince = now_ms();
+            entry->tailPending += bytesToWrite;
+        }
+        sum_append(entry->tailBlock, entry->tailOffset, data + entry->tailOffset, bytesToWrite);
+
+        // Update counters
+        bytesWritten += bytesToWrite;
+        entry->tailOffset += bytesToWrite;
+        file->fileSize += bytesToWrite;
+        dir_mark_dirty(entry->dirIndex);
+
+        if (entry->tailOffset == BLOCKSIZE && tail_flush(entry) < 0)
+            break;
+    }
+
+    // Apply the flush policy to what is left in the buffer. A commit
+    // of this append must find its data written.
+    if (entry->tailPending > 0) {
+        entry->tailAppends++;
+        if (syncCommit || tail_due(entry))
+            tail_flush(entry);
+    }
+
+    pthread_rwlock_unlock(&entry->lock);
+    journal_end();
+    stats_end(VSOP_APPEND, start, bytesWritten);
+    return bytesWritten;
+}
+
+int vsappend(int fd, void *buf, int n) {
+    // Check if the file descriptor is valid
+    if (checkFdValidity(fd) < 0) {
+        vs_log(LOG_ERROR, "Error in vsappend: Either the file descriptor is invalid or the specified file is not open\n");
+        return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = n > 0 ? n : 0;
+    return vsappendv(fd, &iov, 1);
+}
+
+static int delete_file(char *filename)
+{
+    // Search for the file in the root directory
+    int fileIndex = find_file_by_name(filename);
+
+    // If the file is not found, return an error
+    if (fileIndex == -1) {
+        vs_log(LOG_ERROR, "Error in vsdelete: File not found\n");
+        return -1;
+    }
+
+    // A descriptor left open on the file would go on using its slot
+    // and blocks once they belong to other files
+    if (dirOpenFd[fileIndex] != -1) {
+        vs_log(LOG_ERROR, "Error in vsdelete: File is open\n");
+        return -1;
+    }
+
+    // Collect the file's blocks as runs; only metadata changes here and
+    // the host file learns of the freed runs from reclaim_blocks. The
+    // blocks' contents are dead, so cached copies are never written back.
+    ExtentMap freed;
+    memset(&freed, 0, sizeof(ExtentMap));
+    if (extentMode) {
+        ExtentMap map;
+        if (extent_map_load(&map, fileIndex) < 0) {
+            extent_map_free(&map);
+            vs_log(LOG_ERROR, "Error in vsdelete: Could not read the extent list\n");
+            return -1;
+        }
+        // A block shared with a clone only loses this owner
+        int shared = blocks_shared();
+        for (int i = 0; i < map.count; i++) {
+            for (int b = map.extents[i].start; b < map.extents[i].start + map.extents[i].length; b++) {
+                if (shared && ref_add(b, -1) != 0)
+                    continue;
+                cache_discard(b + dataStart);
+                if (extent_map_add(&freed, b, 1) < 0)
+                    release_block(b);
+            }
+        }
+        for (int i = 0; i < map.chainCount; i++) {
+            extent_block_drop(map.chain[i]);
+            cache_discard(map.chain[i] + dataStart);
+            if (extent_map_add(&freed, map.chain[i], 1) < 0)
+                release_block(map.chain[i]);
+        }
+        extent_map_free(&map);
+    }
+    int currentBlock = extentMode || dir_entry(fileIndex)->startBlock == FAT_INLINE
+        ? FAT_NO_NEXT : dir_entry(fileIndex)->startBlock;
+    while (currentBlock != FAT_NO_NEXT) {
+        cache_discard(currentBlock + dataStart);
+        int nextBlock = fat_get(currentBlock);
+        if (extent_map_add(&freed, currentBlock, 1) < 0)
+            release_block(currentBlock); // unpunched, but freed all the same
+        currentBlock = nextBlock;
+    }
+    free_runs(&freed);
+    extent_map_free(&freed);
+
+    // Clear the directory entry for the file
+    dir_index_remove(fileIndex);
+    strcpy(dir_entry(fileIndex)->filename, "\0");
+    dir_entry(fileIndex)->fileSize = 0;
+    dir_entry(fileIndex)->startBlock = FAT_UNALLOCATED;
+    dir_entry(fileIndex)->extentCount = 0;
+    dir_entry(fileIndex)->extentBlock = FAT_NO_NEXT;
+    memset(dir_entry(fileIndex)->inlineData, 0, INLINE_DATA_SIZE);
+    dir_mark_dirty(fileIndex);
+    dirFreeSlots[dirFreeCount++] = fileIndex;
+
+    return 0;
+}
+
+int vsdelete(char *filename)
+{
+    long long start = stats_begin();
+    journal_begin();
+    pthread_rwlock_wrlock(&dirLock);
+    int ret = delete_file(filename);
+    pthread_rwlock_unlock(&dirLock);
+    journal_end();
+    if (!deferReclaim)
+        reclaim_blocks();
+    stats_end(VSOP_DELETE, start, 0);
+    return ret;
+}
+
+// Copy count blocks from data block from to data block to. The host
+// may share the extents instead of copying (reflink); where it cannot
+// copy at all the bytes go through a buffer.
+static int copy_blocks(int from, int to, int count) {
+    loff_t in = (loff_t) (from + dataStart) * BLOCKSIZE;
+    loff_t out = (loff_t) (to + dataStart) * BLOCKSIZE;
+    size_t left = (size_t) count * BLOCKSIZE;
+    while (left > 0) {
+        STAT_ADD(syscalls, 1);
+        ssize_t n = copy_file_range(vs_fd, &in, vs_fd, &out, left, 0);
+        if (n <= 0)
+            break;
+        left -= n;
+    }
+    char buf[BLOCKSIZE];
+    while (left > 0) {
+        size_t n = left < BLOCKSIZE ? left : BLOCKSIZE;
+        STAT_ADD(syscalls, 2);
+        if (pread(vs_fd, buf, n, in) != (ssize_t) n || pwrite(vs_fd, buf, n, out) != (ssize_t) n) {
+            vs_log(LOG_ERROR, "write error\n");
+            return -1;
+        }
+        in += n;
+        out += n;
+        left -= n;
+    }
+    STAT_ADD(blockReads, count);
+    STAT_ADD(blockWrites, count);
+    return 0;
+}
+
+// FAT mode: give file a copy of the chain starting at block, count
+// blocks long. Consecutive blocks on both sides are copied together.
+// The chain cannot be shared: the links live in the FAT, one next
+// entry per block, so a block in two chains would have to be followed
+// by the same block in both, and the first append to either file
+// would relink the other. Only extent mode keeps share counts.
+static int clone_chain(DirectoryEntry *file, int block, int count) {
+    // The source blocks must be in the file for the host to copy them
+    if (cache_flush() < 0)
+        return -1;
+    int first = FAT_NO_NEXT;
+    int prev = -1;
+    int runFrom = -1, runTo = -1, runLength = 0;
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i++) {
+        int b = find_free_block(prev + 1);
+        if (b == -1) {
+            vs_log(LOG_ERROR, "Error in vsclone: No free blocks available in the FAT table\n");
+            ret = -1;
+            break;
+        }
+        cache_discard(b + dataStart);
+        if (prev == -1)
+            first = b;
+        else
+            fat_set(prev, b);
+        prev = b;
+        sum_copy(block, b);
+        if (runLength > 0 && block == runFrom + runLength && b == runTo + runLength) {
+            runLength++;
+        } else {
+            if (runLength > 0 && copy_blocks(runFrom, runTo, runLength) < 0)
+                ret = -1;
+            runFrom = block;
+            runTo = b;
+            runLength = 1;
+        }
+        block = fat_get(block);
+    }
+    if (ret == 0 && runLength > 0 && copy_blocks(runFrom, runTo, runLength) < 0)
+        ret = -1;
+    if (ret < 0) {
+        for (int b = first; b != FAT_NO_NEXT; ) {
+            int next = b == prev ? FAT_NO_NEXT : fat_get(b);
+            release_block(b);
+            b = next;
+        }
+        return -1;
+    }
+    file->startBlock = first;
+    return 0;
+}
+
+static int clone_file(char *source, char *target)
+{
+    int src = find_file_by_name(source);
+    if (src == -1) {
+        vs_log(LOG_ERROR, "Error in vsclone: File not found\n");
+        return -1;
+    }
+    if (find_file_by_name(target) != -1) {
+        vs_log(LOG_ERROR, "Error in vsclone: File already exists\n");
+        return -1;
+    }
+    if (extentMode && refBlocks == 0) {
+        vs_log(LOG_ERROR, "Error in vsclone: Disk was formatted without reference counts\n");
+        return -1;
+    }
+    if (dirFreeCount == 0 && dir_grow() < 0) {
+        vs_log(LOG_ERROR, "Error in vsclone: No empty slots in the root directory\n");
+        return -1;
+    }
+
+    // Keep appends off the source while its blocks are shared, and put
+    // its buffered tail in the block first
+    OpenFileEntry *entry = dirOpenFd[src] != -1 ? fd_entry(dirOpenFd[src]) : NULL;
+    if (entry != NULL) {
+        pthread_rwlock_wrlock(&entry->lock);
+        if (tail_flush(entry) < 0) {
+            pthread_rwlock_unlock(&entry->lock);
+            return -1;
+        }
+    }
+
+    DirectoryEntry *from = dir_entry(src);
+    DirectoryEntry copy;
+    memset(&copy, 0, sizeof(DirectoryEntry));
+    snprintf(copy.filename, MAX_FILENAME_LENGTH, "%s", target);
+    copy.fileSize = from->fileSize;
+    copy.extentBlock = FAT_NO_NEXT;
+    int blocks = (int) (((int64_t) from->fileSize + BLOCKSIZE - 1) / BLOCKSIZE);
+    int slot = dirFreeSlots[dirFreeCount - 1];
+    int ret = 0;
+
+    if (from->startBlock == FAT_INLINE || blocks == 0) {
+        copy.startBlock = FAT_INLINE;
+        if (from->startBlock == FAT_INLINE)
+            memcpy(copy.inlineData, from->inlineData, from->fileSize);
+        *dir_entry(slot) = copy;
+    } else if (!extentMode) {
+        ret = clone_chain(&copy, from->startBlock, blocks);
+        if (ret == 0)
+            *dir_entry(slot) = copy;
+    } else {
+        // Share the blocks holding data; preallocated ones stay the source's
+        ExtentMap map;
+        if (extent_map_load(&map, src) < 0) {
+            vs_log(LOG_ERROR, "Error in vsclone: Could not read the extent list\n");
+            ret = -1;
+        } else {
+            int keep = 0;
+            for (int left = blocks; keep < map.count && left > 0; keep++) {
+                if (map.extents[keep].length > left)
+                    map.extents[keep].length = left;
+                left -= map.extents[keep].length;
+            }
+            map.count = keep;
+            map.blocks = blocks;
+            map.chainCount = 0; // the clone gets extent blocks of its own
+            copy.startBlock = keep > 0 ? map.extents[0].start : FAT_NO_NEXT;
+            *dir_entry(slot) = copy;
+            if (keep == 0 || extent_map_store(&map, slot, 0) < 0) {
+                for (int i = 0; i < map.chainCount; i++)
+                    release_block(map.chain[i]);
+                ret = -1;
+            } else {
+                for (int i = 0; i < map.count; i++) {
+                    for (int b = map.extents[i].start; b < map.extents[i].start + map.extents[i].length; b++)
+                        ref_add(b, 1);
+                }
+            }
+        }
+        extent_map_free(&map);
+    }
+    if (entry != NULL)
+        pthread_rwlock_unlock(&entry->lock);
+    if (ret < 0) {
+        memset(dir_entry(slot), 0, sizeof(DirectoryEntry));
+        dir_entry(slot)->startBlock = FAT_UNALLOCATED;
+        dir_entry(slot)->extentBlock = FAT_NO_NEXT;
+        dir_mark_dirty(slot);
+        return -1;
+    }
+
+    dirFreeCount--;
+    dir_index_insert(slot);
+    dir_mark_dirty(slot);
+    return 0;
+}
+
+// Create file target with the contents of file source. In extent mode
+// the two share data blocks until one of them appends to a shared
+// partial block, which is then copied, so cloning costs metadata
+// only; in FAT mode every block is copied (see clone_chain). Returns 0
+// on success, -1 on failure.
+int vsclone(char *source, char *target)
+{
+    long long start = stats_begin();
+    journal_begin();
+    pthread_rwlock_wrlock(&dirLock);
+    int ret = clone_file(source, target);
+    pthread_rwlock_unlock(&dirLock);
+    journal_end();
+    stats_end(VSOP_CLONE, start, 0);
+    return ret;
+}
+
+/********************************************************************
+    Defragmentation
+
+    Files appended to in turn end up with interleaved blocks, since
+    each allocation takes the lowest free block. vsdefrag copies every
+    such file into the lowest free run long enough to hold it, through
+    a buffer of DEFRAG_BUFFER_BLOCKS, then points the directory entry
+    (and, in FAT mode, the chain) at the copy and frees the old blocks
+    as vsdelete does. Blocks freed by earlier moves are reused once a
+    vssync has made the moves durable.
+********************************************************************/
+
+// Copy the blocks listed in from, in order, to the run starting at
+// data block to. Consecutive source blocks are read with one call.
+static int defrag_copy(int *from, int count, int to, char *buf) {
+    for (int done = 0; done < count; ) {
+        int n = count - done < DEFRAG_BUFFER_BLOCKS ? count - done : DEFRAG_BUFFER_BLOCKS;
+        for (int i = 0; i < n; ) {
+            int run = 1;
+            while (i + run < n && from[done + i + run] == from[done + i] + run)
+                run++;
+            if (disk_read_blocks(buf + (size_t) i * BLOCKSIZE, from[done + i] + dataStart, run) < 0)
+                return -1;
+            i += run;
+        }
+        if (disk_write_blocks(buf, to + done + dataStart, n) < 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Move the file in directory slot slot into one run of blocks. Returns
+// 1 if it was moved, 0 if it was left where it is, -1 on error; sets
+// *noRoom when no free run was long enough. Called with dirLock held.
+static int defrag_file(int slot, char *buf, int *noRoom) {
+    DirectoryEntry *file = dir_entry(slot);
+    int blocks = (int) (((int64_t) file->fileSize + BLOCKSIZE - 1) / BLOCKSIZE);
+    // Open files may have a tail buffered against their current blocks
+    if (file->filename[0] == '\0' || file->startBlock == FAT_INLINE || blocks == 0
+        || dirOpenFd[slot] != -1)
+        return 0;
+
+    // The blocks holding the file's data, in order, and as runs every
+    // block the file owns: preallocated and extent blocks too
+    int *from = (int *)malloc(blocks * sizeof(int));
+    int count = 0;
+    ExtentMap map, old;
+    memset(&map, 0, sizeof(ExtentMap));
+    memset(&old, 0, sizeof(ExtentMap));
+    int ret = from == NULL ? -1 : 0;
+    if (ret == 0 && extentMode) {
+        if (extent_map_load(&map, slot) < 0)
+            ret = -1;
+        // Moving a block shared with a clone would unshare it
+        int shared = blocks_shared();
+        for (int i = 0; ret == 0 && i < map.count; i++) {
+            for (int b = map.extents[i].start; b < map.extents[i].start + map.extents[i].length; b++) {
+                if (shared && ref_count(b) > 0) {
+                    count = -1;
+                    break;
+                }
+                if (count < blocks)
+                    from[count++] = b;
+            }
+            if (count < 0)
+                break;
+            if (extent_map_add(&old, map.extents[i].start, map.extents[i].length) < 0)
+                ret = -1;
+        }
+        for (int i = 0; ret == 0 && count >= 0 && i < map.chainCount; i++) {
+            if (extent_map_add(&old, map.chain[i], 1) < 0)
+                ret = -1;
+        }
+    } else if (ret == 0) {
+        for (int b = file->startBlock; ret == 0 && b >= 0; b = fat_get(b)) {
+            if (count < blocks)
+                from[count++] = b;
+            if (extent_map_add(&old, b, 1) < 0)
+                ret = -1;
+        }
+    }
+    if (ret < 0)
+        vs_log(LOG_ERROR, "Error in vsdefrag: Could not read the blocks of %s\n", file->filename);
+    if (ret == 0 && count >= 0 && count < blocks)
+        vs_log(LOG_ERROR, "Error in vsdefrag: %s has fewer blocks than its size; left as it is\n", file->filename);
+
+    int contiguous = 1;
+    for (int i = 1; i < count; i++) {
+        if (from[i] != from[0] + i)
+            contiguous = 0;
+    }
+    int to = -1;
+    if (ret == 0 && count == blocks && !contiguous) {
+        // The data may still be in dirty cached blocks
+        if (cache_flush() < 0)
+            ret = -1;
+        else
+            to = find_free_span(blocks);
+        if (ret == 0 && to == -1)
+            *noRoom = 1;
+    }
+    if (to != -1) {
+        for (int i = 0; i < blocks; i++)
+            cache_discard(to + i + dataStart);
+        if (defrag_copy(from, blocks, to, buf) < 0) {
+            for (int i = 0; i < blocks; i++)
+                release_block(to + i);
+            ret = -1;
+        } else {
+            // Point the file at the copy; the old blocks go as a deleted file's do
+            if (extentMode) {
+                file->extents[0].start = to;
+                file->extents[0].length = blocks;
+                file->extentCount = 1;
+                file->extentBlock = FAT_NO_NEXT;
+                for (int i = 0; i < map.chainCount; i++)
+                    extent_block_drop(map.chain[i]);
+            } else {
+                for (int i = 0; i + 1 < blocks; i++)
+                    fat_set(to + i, to + i + 1);
+            }
+            for (int i = 0; i < blocks; i++)
+                sum_copy(from[i], to + i);
+            file->startBlock = to;
+            dir_mark_dirty(slot);
+            for (int r = 0; r < old.count; r++) {
+                for (int b = old.extents[r].start; b < old.extents[r].start + old.extents[r].length; b++)
+                    cache_discard(b + dataStart);
+            }
+            free_runs(&old);
+            ret = 1;
+        }
+    }
+    extent_map_free(&map);
+    extent_map_free(&old);
+    free(from);
+    return ret;
+}
+
+// Move every file whose blocks are not one run into one, so that it
+// reads back sequentially. Meant for a volume nothing else is using:
+// open files, and in extent mode files sharing blocks with a clone,
+// are left where they are, as are files no free run can hold. Returns
+// the number of files moved, or -1 on error.
+int vsdefrag()
+{
+    char *buf = (char *)malloc((size_t) DEFRAG_BUFFER_BLOCKS * BLOCKSIZE);
+    if (buf == NULL) {
+        vs_log(LOG_ERROR, "Error in vsdefrag: Out of memory\n");
+        return -1;
+    }
+    int moved = 0;
+    int pending = 0; // moves whose old blocks cannot be reused yet
+    int ret = 0;
+    for (int slot = 0; ret == 0; ) {
+        int noRoom = 0;
+        int r = 0;
+        journal_begin();
+        pthread_rwlock_wrlock(&dirLock);
+        int done = slot >= dirLength;
+        if (!done)
+            r = defrag_file(slot, buf, &noRoom);
+        pthread_rwlock_unlock(&dirLock);
+        journal_end();
+        if (done)
+            break;
+        if (r < 0) {
+            ret = -1;
+        } else if (noRoom && pending > 0) {
+            // Try the file again with the blocks of the earlier moves
+            if (vssync() < 0)
+                ret = -1;
+            else
+                reclaim_blocks();
+            pending = 0;
+        } else {
+            moved += r;
+            pending += r;
+            slot++;
+        }
+    }
+    if (pending > 0) {
+        if (vssync() < 0)
+            ret = -1;
+        else
+            reclaim_blocks();
+    }
+    free(buf);
+    return ret < 0 ? -1 : moved;
+}
+
+/********************************************************************
+    Consistency check
+
+    vsfsck follows every file's chain or extents and notes, for each
+    data block, which file has it and how many of its bytes are file
+    data. It reports blocks in two files (or twice in one), blocks a
+    file has that the FAT calls free, allocated blocks in no file,
+    sizes the blocks do not match and, in extent mode, share counts
+    that do not match the number of files. With VSFSCK_SCRUB it then
+    splits the data region between worker threads, which read it in
+    runs of SCRUB_CHUNK_BLOCKS and check each file block against its
+    checksum. Nothing is repaired.
+********************************************************************/
+
+typedef struct {
+    int *owner; // per data block: slot + 1 of the file having it, -1 for the directory, 0 for none
+    unsigned short *owners; // files having it
+    unsigned short *used; // bytes of file data in it; 0 for extent and preallocated blocks
+    unsigned int *sums; // scrub only: the checksums of the blocks with data
+    int problems;
+} Fsck;
+
+static void fsck_report(Fsck *f, const char *format, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(msg, sizeof(msg), format, ap);
+    va_end(ap);
+    printf("vsfsck: %s\n", msg); // one call, so scrub threads do not interleave
+    __atomic_fetch_add(&f->problems, 1, __ATOMIC_RELAXED);
+}
+
+static const char *fsck_name(int owner) {
+    return owner > 0 ? dir_entry(owner - 1)->filename : "the directory";
+}
+
+// Note that data block b belongs to owner, used bytes of it file data.
+// Returns -1 if it already belonged to owner.
+static int fsck_claim(Fsck *f, int b, int owner, int used) {
+    int had = f->owner[b];
+    if (had == 0) {
+        f->owner[b] = owner;
+        f->owners[b] = 1;
+        f->used[b] = used;
+        return 0;
+    }
+    if (had == owner) {
+        fsck_report(f, "%s has block %d twice", fsck_name(owner), b);
+        return -1;
+    }
+    if (extentMode && refBlocks > 0 && had > 0 && owner > 0 && used > 0 && f->used[b] > 0) {
+        // A clone; the share count is checked against owners later
+        if (f->owners[b] < USHRT_MAX)
+            f->owners[b]++;
+        if (used != f->used[b])
+            fsck_report(f, "block %d has %d bytes of %s but %d of %s", b, f->used[b], fsck_name(had), used, fsck_name(owner));
+        return 0;
+    }
+    fsck_report(f, "block %d is in both %s and %s", b, fsck_name(had), fsck_name(owner));
+    return 0;
+}
+
+// Check that b is a data block the FAT has allocated. Returns -1 if not.
+static int fsck_block(Fsck *f, int b, int owner) {
+    if (b < 0 || b >= dataBlocks) {
+        fsck_report(f, "%s has block %d, outside the data region", fsck_name(owner), b);
+        return -1;
+    }
+    if (fat_get(b) == FAT_UNALLOCATED) {
+        fsck_report(f, "%s has block %d, which the FAT has free", fsck_name(owner), b);
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes of file data in the index-th block of file
+static int fsck_used(DirectoryEntry *file, int index) {
+    int64_t left = (int64_t) file->fileSize - (int64_t) index * BLOCKSIZE;
+    return left >= BLOCKSIZE ? BLOCKSIZE : left > 0 ? (int) left : 0;
+}
+
+static void fsck_file(Fsck *f, int slot) {
+    DirectoryEntry *file = dir_entry(slot);
+    int owner = slot + 1;
+    if (file->fileSize < 0) {
+        fsck_report(f, "%s has size %d", file->filename, file->fileSize);
+        return;
+    }
+    if (file->startBlock == FAT_INLINE) {
+        if (file->fileSize > (int) INLINE_DATA_SIZE)
+            fsck_report(f, "%s is inline with %d bytes, more than %d fit", file->filename, file->fileSize, (int) INLINE_DATA_SIZE);
+        return;
+    }
+
+    int needed = (int) (((int64_t) file->fileSize + BLOCKSIZE - 1) / BLOCKSIZE);
+    int count = 0;
+    if (!extentMode) {
+        for (int b = file->startBlock; b != FAT_NO_NEXT && count <= dataBlocks; b = fat_get(b)) {
+            if (fsck_block(f, b, owner) < 0 || fsck_claim(f, b, owner, fsck_used(file, count)) < 0)
+                break;
+            count++;
+        }
+    } else {
+        ExtentMap map;
+        if (extent_map_load(&map, slot) < 0) {
+            fsck_report(f, "the extent list of %s cannot be read", file->filename);
+            extent_map_free(&map);
+            return;
+        }
+        for (int i = 0; i < map.chainCount; i++) {
+            if (fsck_block(f, map.chain[i], owner) == 0)
+                fsck_claim(f, map.chain[i], owner, 0);
+        }
+        for (int i = 0; i < map.count; i++) {
+            for (int j = 0; j < map.extents[i].length; j++) {
+                int b = map.extents[i].start + j;
+                if (fsck_block(f, b, owner) == 0)
+                    fsck_claim(f, b, owner, fsck_used(file, count));
+                count++;
+            }
+        }
+        if (map.count > 0 && file->startBlock != map.extents[0].start)
+            fsck_report(f, "%s starts at block %d but its first extent at %d", file->filename, file->startBlock, map.extents[0].start);
+        extent_map_free(&map);
+    }
+    // Extent mode keeps preallocated blocks past the end; an empty
+    // file from before inline files still has the block vscreate gave it
+    if (extentMode ? count < needed : count != needed && !(needed == 0 && count == 1))
+        fsck_report(f, "%s is %d bytes, %d blocks, but has %d", file->filename, file->fileSize, needed, count);
+}
+
+typedef struct {
+    Fsck *f;
+    int first; // data blocks first to last - 1
+    int last;
+} ScrubSlice;
+
+static void *scrub_worker(void *arg) {
+    ScrubSlice *slice = (ScrubSlice *) arg;
+    Fsck *f = slice->f;
+    char *buf = (char *)malloc((size_t) SCRUB_CHUNK_BLOCKS * BLOCKSIZE);
+    if (buf == NULL) {
+        fsck_report(f, "no memory to scrub blocks %d to %d", slice->first, slice->last - 1);
+        return NULL;
+    }
+    for (int b = slice->first; b < slice->last; b += SCRUB_CHUNK_BLOCKS) {
+        // Read from the first to the last block with file data
+        int lo = b;
+        int hi = b + SCRUB_CHUNK_BLOCKS < slice->last ? b + SCRUB_CHUNK_BLOCKS : slice->last;
+        while (lo < hi && f->used[lo] == 0)
+            lo++;
+        while (hi > lo && f->used[hi - 1] == 0)
+            hi--;
+        if (lo == hi)
+            continue;
+        if (disk_read_blocks(buf, lo + dataStart, hi - lo) < 0) {
+            fsck_report(f, "blocks %d to %d cannot be read", lo, hi - 1);
+            continue;
+        }
+        STAT_ADD(scrubbedBlocks, hi - lo);
+        for (int i = lo; i < hi; i++) {
+            if (f->used[i] > 0 && crc32c(buf + (size_t) (i - lo) * BLOCKSIZE, f->used[i]) != f->sums[i])
+                fsck_report(f, "block %d of %s does not match its checksum", i, fsck_name(f->owner[i]));
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Check every file block against its checksum, on threads threads
+static void scrub(Fsck *f, int threads) {
+    f->sums = (unsigned int *)malloc((size_t) dataBlocks * sizeof(unsigned int));
+    if (f->sums == NULL) {
+        fsck_report(f, "no memory for the checksums");
+        return;
+    }
+    for (int b = 0; b < dataBlocks; b++) {
+        int sum = 0;
+        if (f->used[b] > 0 && table_get(&sumTable, b, &sum) < 0)
+            fsck_report(f, "the checksum of block %d cannot be read", b);
+        f->sums[b] = (unsigned int) sum;
+    }
+
+    // Equal slices, whole chunks each
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_SCRUB_THREADS)
+        threads = MAX_SCRUB_THREADS;
+    int chunks = (dataBlocks + SCRUB_CHUNK_BLOCKS - 1) / SCRUB_CHUNK_BLOCKS;
+    int per = (chunks + threads - 1) / threads;
+    ScrubSlice slices[MAX_SCRUB_THREADS];
+    pthread_t tid[MAX_SCRUB_THREADS];
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        int64_t first = (int64_t) t * per * SCRUB_CHUNK_BLOCKS;
+        int64_t last = first + (int64_t) per * SCRUB_CHUNK_BLOCKS;
+        if (first >= dataBlocks)
+            break;
+        slices[t] = (ScrubSlice) { f, (int) first, last < dataBlocks ? (int) last : dataBlocks };
+        if (t == threads - 1 || pthread_create(&tid[t], NULL, scrub_worker, &slices[t]) != 0)
+            scrub_worker(&slices[t]); // the last slice, or one no thread could take
+        else
+            started = t + 1;
+    }
+    for (int t = 0; t < started; t++)
+        pthread_join(tid[t], NULL);
+    free(f->sums);
+}
+
+// Check the mounted volume, and with VSFSCK_SCRUB the data against
+// its checksums using up to threads threads. Each problem is printed.
+// Returns the number of problems, or -1 if the check could not run.
+int vsfsck(int flags, int threads)
+{
+    // The scrub reads the disk, so buffered data must be on it
+    if (tail_flush_all() < 0 || cache_flush() < 0) {
+        vs_log(LOG_ERROR, "Error in vsfsck: Could not write back buffered data\n");
+        return -1;
+    }
+    Fsck f;
+    memset(&f, 0, sizeof(Fsck));
+    f.owner = (int *)calloc(dataBlocks, sizeof(int));
+    f.owners = (unsigned short *)calloc(dataBlocks, sizeof(unsigned short));
+    f.used = (unsigned short *)calloc(dataBlocks, sizeof(unsigned short));
+    if (f.owner == NULL || f.owners == NULL || f.used == NULL) {
+        vs_log(LOG_ERROR, "Error in vsfsck: Out of memory\n");
+        free(f.owner);
+        free(f.owners);
+        free(f.used);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&dirLock);
+    for (int i = 0; i < dirBlockCount - rootDirBlocks; i++) {
+        if (fsck_block(&f, dirExtBlockNo[i], -1) == 0)
+            fsck_claim(&f, dirExtBlockNo[i], -1, 0);
+    }
+    for (int slot = 0; slot < dirLength; slot++) {
+        if (dir_entry(slot)->filename[0] != '\0')
+            fsck_file(&f, slot);
+    }
+
+    // Then the other way round, from the FAT and share counts
+    int leaked = 0;
+    int firstLeaked = -1;
+    int shared = 0;
+    for (int b = 0; b < dataBlocks; b++) {
+        int next = fat_get(b);
+        if (next < FAT_NO_NEXT || next >= dataBlocks) {
+            fsck_report(&f, "FAT entry %d holds %d", b, next);
+        } else if (next != FAT_UNALLOCATED && f.owner[b] == 0) {
+            if (leaked++ == 0)
+                firstLeaked = b;
+        }
+        if (refBlocks > 0) {
+            int count = ref_count(b);
+            int want = f.owners[b] > 1 ? f.owners[b] - 1 : 0;
+            if (count != want)
+                fsck_report(&f, "block %d has a share count of %d but is in %d files", b, count, f.owners[b]);
+            if (count > 0)
+                shared++;
+        }
+    }
+    if (leaked > 0)
+        fsck_report(&f, "%d blocks are allocated but in no file, the first %d", leaked, firstLeaked);
+    if (refBlocks > 0 && shared != superblock.sharedBlocks)
+        fsck_report(&f, "the superblock counts %d shared blocks, the table %d", superblock.sharedBlocks, shared);
+
+    if (flags & VSFSCK_SCRUB) {
+        if (sumBlocks == 0)
+            printf("vsfsck: the disk was formatted without checksums; nothing to scrub\n");
+        else
+            scrub(&f, threads);
+    }
+    pthread_rwlock_unlock(&dirLock);
+
+    free(f.owner);
+    free(f.owners);
+    free(f.used);
+    return f.problems;
+}
+
+/********************************************************************
+    Asynchronous I/O
+
+    vsread_async and vsappend_async queue a request and return a
+    handle at once; a pool of worker threads, started by the first
+    submission, carries the requests out. A read claims its part of
+    the file at submission, so reads on one descriptor get the data
+    in the order they were submitted even though they run in
+    parallel. Appends on one descriptor take a ticket at submission
+    and are applied in ticket order.
+
+    asyncLock guards the queue, the request slots and the per-file
+    ticket counters; workers take an open file's lock only after
+    dropping it.
+********************************************************************/
+typedef struct AsyncRequest {
+    int handle; // current handle of this slot, -1 while the slot is free
+    int fd;
+    int write; // 1 for an append
+    char *buf;
+    int n;
+    int startBlock; // reads: where the claimed bytes start
+    int startOffset;
+    int ticket; // appends: position among the descriptor's appends
+    vsasync_callback callback;
+    void *arg;
+    int done;
+    int result;
+    struct AsyncRequest *next; // submission queue or free list
+} AsyncRequest;
+
+AsyncRequest asyncSlots[ASYNC_MAX_REQUESTS];
+AsyncRequest *asyncFree = NULL;
+AsyncRequest *asyncHead = NULL; // oldest queued request
+AsyncRequest *asyncTail = NULL;
+int asyncGeneration = 0; // bumped per submission, keeps handles unique
+pthread_t *asyncThreads = NULL;
+int asyncThreadCount = 0;
+int asyncStopping = 0;
+pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t asyncWork = PTHREAD_COND_INITIALIZER; // queue not empty or stopping
+pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER; // a request completed
+
+static void async_run(AsyncRequest *req) {
+    OpenFileEntry *entry = fd_entry(req->fd);
+    if (!req->write) {
+        struct iovec iov;
+        iov.iov_base = req->buf;
+        iov.iov_len = req->n;
+        IovCursor c;
+        iov_init(&c, &iov, 1);
+        long long start = stats_begin();
+        pthread_rwlock_rdlock(&entry->lock);
+        req->result = read_chain(entry, req->startBlock, req->startOffset % BLOCKSIZE, &c, req->n);
+        pthread_rwlock_unlock(&entry->lock);
+        stats_end(VSOP_READ, start, req->result);
+        return;
+    }
+
+    // Wait for the appends submitted before this one
+    pthread_mutex_lock(&asyncLock);
+    while (entry->asyncServing != req->ticket)
+        pthread_cond_wait(&asyncDone, &asyncLock);
+    pthread_mutex_unlock(&asyncLock);
+    req->result = vsappend(req->fd, req->buf, req->n);
+    pthread_mutex_lock(&asyncLock);
+    entry->asyncServing++;
+    pthread_mutex_unlock(&asyncLock);
+}
+
+static void *async_worker(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&asyncLock);
+    for (;;) {
+        while (asyncHead == NULL && !asyncStopping)
+            pthread_cond_wait(&asyncWork, &asyncLock);
+        if (asyncHead == NULL)
+            break;
+        AsyncRequest *req = asyncHead;
+        asyncHead = req->next;
+        if (asyncHead == NULL)
+            asyncTail = NULL;
+        pthread_mutex_unlock(&asyncLock);
+
+        async_run(req);
+        if (req->callback != NULL)
+            req->callback(req->handle, req->result, req->arg);
+
+        pthread_mutex_lock(&asyncLock);
+        req->done = 1;
+        fd_entry(req->fd)->asyncPending--;
+        if (req->callback != NULL) {
+            // Nobody waits on a request with a callback
+            req->handle = -1;
+            req->next = asyncFree;
+            asyncFree = req;
+        }
+        pthread_cond_broadcast(&asyncDone);
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return NULL;
+}
+
+// Start the worker threads. Called with asyncLock held.
+static int async_start() {
+    int threads = DEFAULT_ASYNC_THREADS;
+    char *env = getenv("VSFS_ASYNC_THREADS");
+    if (env != NULL && atoi(env) > 0)
+        threads = atoi(env);
+    asyncThreads = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (asyncThreads == NULL)
+        return -1;
+    asyncStopping = 0;
+    asyncFree = NULL;
+    for (int i = ASYNC_MAX_REQUESTS - 1; i >= 0; i--) {
+        asyncSlots[i].handle = -1;
+        asyncSlots[i].next = asyncFree;
+        asyncFree = &asyncSlots[i];
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&asyncThreads[i], NULL, async_worker, NULL) != 0)
+            break;
+        asyncThreadCount++;
+    }
+    return asyncThreadCount > 0 ? 0 : -1;
+}
+
+// Wait until every request submitted on fd has completed
+void async_drain(int fd) {
+    pthread_mutex_lock(&asyncLock);
+    OpenFileEntry *entry = fd_entry(fd);
+    while (entry->asyncPending > 0)
+        pthread_cond_wait(&asyncDone, &asyncLock);
+    entry->asyncNextTicket = 0;
+    entry->asyncServing = 0;
+    pthread_mutex_unlock(&asyncLock);
+}
+
+// Finish all queued requests and stop the workers
+void async_shutdown() {
+    pthread_mutex_lock(&asyncLock);
+    asyncStopping = 1;
+    pthread_cond_broadcast(&asyncWork);
+    pthread_mutex_unlock(&asyncLock);
+    for (int i = 0; i < asyncThreadCount; i++)
+        pthread_join(asyncThreads[i], NULL);
+    free(asyncThreads);
+    asyncThreads = NULL;
+    asyncThreadCount = 0;
+    asyncFree = NULL;
+    for (int i = 0; i < openFileCount; i++) {
+        fd_entry(i)->asyncPending = 0;
+        fd_entry(i)->asyncNextTicket = 0;
+        fd_entry(i)->asyncServing = 0;
+    }
+}
+
+static int async_submit(int fd, int write, void *buf, int n, vsasync_callback callback, void *arg) {
+    const char *name = write ? "vsappend_async" : "vsread_async";
+    if (checkFdValidity(fd) < 0 || n < 0) {
+        vs_log(LOG_ERROR, "Error in %s: Either the file descriptor is invalid or the specified file is not open\n", name);
+        return -1;
+    }
+    if (write && fd_entry(fd)->mode != MODE_APPEND) {
+        vs_log(LOG_ERROR, "Error in %s: The file is not open for appending\n", name);
+        return -1;
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    if (asyncThreadCount == 0 && async_start() < 0) {
+        pthread_mutex_unlock(&asyncLock);
+        vs_log(LOG_ERROR, "Error in %s: Could not start the I/O threads\n", name);
+        return -1;
+    }
+    AsyncRequest *req = asyncFree;
+    if (req == NULL) {
+        pthread_mutex_unlock(&asyncLock);
+        vs_log(LOG_ERROR, "Error in %s: Too many requests in flight\n", name);
+        return -1;
+    }
+    asyncFree = req->next;
+    req->handle = asyncGeneration++ % (INT_MAX / ASYNC_MAX_REQUESTS) * ASYNC_MAX_REQUESTS
+                  + (int) (req - asyncSlots);
+    req->fd = fd;
+    req->write = write;
+    req->buf = (char *)buf;
+    req->n = n;
+    req->callback = callback;
+    req->arg = arg;
+    req->done = 0;
+    req->result = 0;
+    req->next = NULL;
+    if (write)
+        req->ticket = fd_entry(fd)->asyncNextTicket++;
+    fd_entry(fd)->asyncPending++;
+    int handle = req->handle;
+    pthread_mutex_unlock(&asyncLock);
+
+    if (!write) {
+        // Claim the bytes now so reads complete in submission order
+        OpenFileEntry *entry = fd_entry(fd);
+        pthread_rwlock_rdlock(&entry->lock);
+        req->n = claim_read(entry, n, &req->startBlock, &req->startOffset);
+        pthread_rwlock_unlock(&entry->lock);
+    }
+
+    pthread_mutex_lock(&asyncLock);
+    if (asyncTail != NULL)
+        asyncTail->next = req;
+    else
+        asyncHead = req;
+    asyncTail = req;
+    pthread_cond_signal(&asyncWork);
+    pthread_mutex_unlock(&asyncLock);
+    return handle;
+}
+
+// Queue a read of up to n bytes at the read cursor. Returns a handle,
+// or -1 on error. callback, if not NULL, is called from an I/O thread
+// with the number of bytes read; the handle is then released.
+// Otherwise the caller collects the result with vswait.
+int vsread_async(int fd, void *buf, int n, vsasync_callback callback, void *arg) {
+    return async_submit(fd, 0, buf, n, callback, arg);
+}
+
+// Queue an append of n bytes; handles and callbacks as vsread_async
+int vsappend_async(int fd, void *buf, int n, vsasync_callback callback, void *arg) {
+    return async_submit(fd, 1, buf, n, callback, arg);
+}
+
+// Slot of a handle returned without a callback. Called with asyncLock held.
+static AsyncRequest *async_lookup(int handle) {
+    if (handle < 0)
+        return NULL;
+    AsyncRequest *req = &asyncSlots[handle % ASYNC_MAX_REQUESTS];
+    if (req->handle != handle || req->callback != NULL)
+        return NULL;
+    return req;
+}
+
+// Returns 1 if the request has completed, 0 if not, -1 for a bad handle
+int vspoll(int handle) {
+    pthread_mutex_lock(&asyncLock);
+    AsyncRequest *req = async_lookup(handle);
+    int ret = req == NULL ? -1 : req->done;
+    pthread_mutex_unlock(&asyncLock);
+    if (ret < 0)
+        vs_log(LOG_ERROR, "Error in vspoll: Invalid handle\n");
+    return ret;
+}
+
+// Wait for the request to complete, release its handle and return its
+// result: bytes read or appended, or -1.
+int vswait(int handle) {
+    pthread_mutex_lock(&asyncLock);
+    AsyncRequest *req = async_lookup(handle);
+    if (req == NULL) {
+        pthread_mutex_unlock(&asyncLock);
+        vs_log(LOG_ERROR, "Error in vswait: Invalid handle\n");
+        return -1;
+    }
+    while (!req->done)
+        pthread_cond_wait(&asyncDone, &asyncLock);
+    int result = req->result;
+    req->handle = -1;
+    req->next = asyncFree;
+    asyncFree = req;
+    pthread_mutex_unlock(&asyncLock);
+    return result;
+}
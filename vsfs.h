@@ -2,9 +2,18 @@
 
 // Do not change this file //
 
+#include <sys/uio.h>
+
 #define MODE_READ 0
 #define MODE_APPEND 1
 #define BLOCKSIZE 2048 // bytes
+#define MOUNT_BUFFERED 0
+#define MOUNT_MMAP 1 // metadata is mapped, so the kernel may write it back before its journal
+                     // transaction commits; a crash can then leave uncommitted metadata on
+                     // disk. Use MOUNT_BUFFERED where crash consistency matters.
+#define FORMAT_EXTENTS 1 // vsformatx: map files by extents instead of FAT chains
+#define FORMAT_CHECKSUMS 2 // vsformatx: keep a CRC-32C of each data block
+#define VSFSCK_SCRUB 1 // vsfsck: also read every file block and check its checksum
 
 int vsformat (char *vdiskname, unsigned int m);
 
@@ -27,3 +36,69 @@ int vsappend(int fd, void *buf, int n);
 int vsdelete(char *filename);
 
 
+int vssync();
+
+int vsmount_mode (char *vdiskname, int mode);
+
+int vsreadv(int fd, const struct iovec *iov, int iovcnt);
+
+int vsappendv(int fd, const struct iovec *iov, int iovcnt);
+
+int vspread(int fd, void *buf, int n, int offset);
+
+int vsseek(int fd, int offset);
+
+
+int vsformatx (char *vdiskname, unsigned int m, int flags);
+
+typedef void (*vsasync_callback)(int handle, int result, void *arg);
+
+int vsread_async(int fd, void *buf, int n, vsasync_callback callback, void *arg);
+
+int vsappend_async(int fd, void *buf, int n, vsasync_callback callback, void *arg);
+
+int vspoll(int handle);
+
+int vswait(int handle);
+
+// Extent volumes share the source's blocks copy-on-write; FAT volumes
+// get a full copy of the data, since a FAT chain cannot be shared
+int vsclone(char *source, char *target);
+
+int vsdefrag();
+
+int vsfsck(int flags, int threads);
+
+#define VSOP_CREATE 0
+#define VSOP_OPEN 1
+#define VSOP_CLOSE 2
+#define VSOP_READ 3 // vsread, vsreadv, vspread and async reads
+#define VSOP_APPEND 4 // vsappend, vsappendv and async appends
+#define VSOP_DELETE 5
+#define VSOP_SYNC 6
+#define VSOP_CLONE 7
+#define VSOP_COUNT 8
+#define VSSTATS_BUCKETS 24 // latency[op][b] counts calls under 2^b microseconds
+
+// Counters since vsmount; every field is a long long
+struct vsstats {
+    long long blockReads; // blocks read from the virtual disk file
+    long long blockWrites; // blocks written to it
+    long long syscalls; // reads, writes and syncs issued on it
+    long long cacheHits;
+    long long cacheMisses;
+    long long fatHops; // FAT entries followed
+    long long allocCalls; // single-block allocations
+    long long allocScanWords; // free-map words they scanned past the hint
+    long long commits; // journal transactions made durable
+    long long checkpoints; // times the journal was emptied
+    long long punches; // fallocate calls that punched freed blocks out of the disk file
+    long long reclaimedBlocks; // freed blocks returned to the allocator
+    long long cowCopies; // shared tail blocks copied before an append
+    long long scrubbedBlocks; // blocks the vsfsck scrub read and checked
+    long long calls[VSOP_COUNT];
+    long long bytes[VSOP_COUNT]; // bytes read or appended
+    long long latency[VSOP_COUNT][VSSTATS_BUCKETS];
+};
+
+int vsstats(struct vsstats *stats);
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include "vsfs.h"
+
+// Check a virtual disk: FAT and directory consistency, and with -s a
+// scrub of every file block against its checksum. Mounting replays the
+// journal first. The disk must not be mounted by anyone else. Exits 0
+// if the disk is clean, 1 if problems were found, 2 if it could not be
+// checked.
+
+static void usage() {
+    printf("usage: vsfsck [-s] [-t threads] <vdiskname>\n"
+           "  -s  scrub: read all file data and check it against the block checksums\n"
+           "  -t  scrub threads, by default one per CPU\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    int flags = 0;
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "st:")) != -1) {
+        switch (opt) {
+        case 's': flags |= VSFSCK_SCRUB; break;
+        case 't': threads = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1 || threads < 1)
+        usage();
+    char *vdiskname = argv[optind];
+
+    if (vsmount(vdiskname) != 0) {
+        printf("could not mount %s\n", vdiskname);
+        exit(2);
+    }
+    struct vsstats before, after;
+    struct timespec t0, t1;
+    vsstats(&before);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int problems = vsfsck(flags, threads);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    vsstats(&after);
+    int unmounted = vsumount();
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    long long scrubbed = after.scrubbedBlocks - before.scrubbedBlocks;
+    double mb = scrubbed * (double) BLOCKSIZE / (1024 * 1024);
+    if (problems < 0 || unmounted != 0) {
+        printf("%s could not be checked\n", vdiskname);
+        exit(2);
+    }
+    // Without checksums, or without file data, there was nothing to time
+    if (scrubbed > 0)
+        printf("read %.1f MB in %.3f s (%.1f MB/s) with %d threads\n", mb, secs, secs > 0 ? mb / secs : 0, threads);
+    if (problems > 0) {
+        printf("%s: %d problems\n", vdiskname, problems);
+        exit(1);
+    }
+    printf("%s: clean\n", vdiskname);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include "vsfs.h"
+
+// Regression tests. Each case formats the virtual disk afresh, once
+// with FAT chains and once with extents, and returns 0 if it passed.
+
+char vdiskname[200];
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+// Append n bytes of c to the file open on fd
+static int fill(int fd, char c, int n) {
+    char buf[n];
+    memset(buf, c, n);
+    return vsappend(fd, buf, n);
+}
+
+// Whether the n bytes of file name from offset on are all c
+static int holds(char *name, int offset, char c, int n) {
+    char buf[n];
+    int fd = vsopen(name, MODE_READ);
+    int got = vspread(fd, buf, n, offset);
+    vsclose(fd);
+    if (got != n)
+        return 0;
+    for (int i = 0; i < n; i++)
+        if (buf[i] != c)
+            return 0;
+    return 1;
+}
+
+// An append through a descriptor opened for reading is refused
+static int append_to_read_fd() {
+    vscreate("a");
+    vscreate("b");
+    int fd = vsopen("a", MODE_APPEND);
+    CHECK(fill(fd, 'A', 3000) == 3000);
+    vsclose(fd);
+    fd = vsopen("b", MODE_APPEND);
+    CHECK(fill(fd, 'B', 100) == 100);
+    vsclose(fd);
+
+    fd = vsopen("b", MODE_READ);
+    CHECK(fill(fd, 'X', 100) == -1);
+    CHECK(vssize(fd) == 100);
+    vsclose(fd);
+    CHECK(holds("a", 0, 'A', 3000));
+    CHECK(holds("b", 0, 'B', 100));
+    return 0;
+}
+
+// A read that stops at the end of the file on a block boundary
+// continues into bytes appended after it
+static int read_after_append() {
+    char buf[BLOCKSIZE];
+    vscreate("a");
+    int fd = vsopen("a", MODE_APPEND);
+    CHECK(fill(fd, 'A', BLOCKSIZE) == BLOCKSIZE);
+    CHECK(vsread(fd, buf, BLOCKSIZE) == BLOCKSIZE);
+    CHECK(vsread(fd, buf, 1) == 0);
+    CHECK(fill(fd, 'B', 100) == 100);
+    CHECK(vsread(fd, buf, 100) == 100);
+    CHECK(buf[0] == 'B' && buf[99] == 'B');
+    vsclose(fd);
+    return 0;
+}
+
+// An append whose size overflows an int is refused, and one just
+// short of that neither overruns the inline bytes nor the file size
+static int append_near_int_max() {
+    int size = 4 << 20; // more than the disk holds
+    char *buf = malloc(size);
+    CHECK(buf != NULL);
+    memset(buf, 'B', size);
+    vscreate("a");
+    int fd = vsopen("a", MODE_APPEND);
+    CHECK(fill(fd, 'A', 10) == 10);
+    CHECK(vsappend(fd, buf, INT_MAX - 5) == -1);
+    CHECK(vssize(fd) == 10);
+    int n = vsappend(fd, buf, INT_MAX - 10);
+    free(buf);
+    CHECK(n > 0 && n < size);
+    CHECK(vssize(fd) == 10 + n);
+    vsclose(fd);
+    CHECK(holds("a", 0, 'A', 10));
+    CHECK(holds("a", 10, 'B', BLOCKSIZE));
+    return 0;
+}
+
+// A file cannot be deleted while a descriptor is open on it, so the
+// descriptor never reaches a file created in its slot
+static int delete_open_file() {
+    vscreate("a");
+    int fd = vsopen("a", MODE_APPEND);
+    CHECK(fill(fd, 'A', 2500) == 2500);
+    CHECK(vsdelete("a") == -1);
+    vsclose(fd);
+    CHECK(vsdelete("a") == 0);
+
+    vscreate("a");
+    vscreate("c");
+    fd = vsopen("a", MODE_APPEND);
+    int fdc = vsopen("c", MODE_APPEND);
+    CHECK(fill(fdc, 'C', 3000) == 3000);
+    vsclose(fdc);
+    CHECK(vsdelete("a") == -1);
+    CHECK(fill(fd, 'A', 500) == 500);
+    vsclose(fd);
+    CHECK(holds("a", 0, 'A', 500));
+    CHECK(holds("c", 0, 'C', 3000));
+    return 0;
+}
+
+// A crash after a delete that has not committed leaves the file as it
+// was, not with its blocks punched or given to another file
+static int crash_after_delete() {
+    vsumount();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (vsmount(vdiskname) != 0 || vscreate("a") != 0)
+            _exit(1);
+        int fd = vsopen("a", MODE_APPEND);
+        if (fill(fd, 'A', 65536) != 65536)
+            _exit(1);
+        vsclose(fd);
+        if (vssync() != 0 || vsdelete("a") != 0 || vscreate("b") != 0)
+            _exit(1);
+        fd = vsopen("b", MODE_APPEND);
+        fill(fd, 'B', 65536);
+        _exit(0); // no vssync or vsumount
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(vsmount(vdiskname) == 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(vsfsck(0, 1) == 0);
+    int fd = vsopen("a", MODE_READ);
+    if (fd != -1) {
+        CHECK(vssize(fd) == 65536);
+        vsclose(fd);
+        CHECK(holds("a", 0, 'A', 65536));
+    }
+    return 0;
+}
+
+// A group commit that the journal fills up for writes the bytes still
+// buffered in another file's tail along with the size that covers them
+static int crash_after_group_commit() {
+    vsumount();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (vsmount(vdiskname) != 0 || vscreate("a") != 0)
+            _exit(1);
+        int fd = vsopen("a", MODE_APPEND);
+        if (fill(fd, 'A', BLOCKSIZE + 100) != BLOCKSIZE + 100)
+            _exit(1);
+        struct vsstats st;
+        vsstats(&st);
+        long long commits = st.commits;
+        char name[32];
+        for (int i = 0; st.commits == commits; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            if (vscreate(name) != 0)
+                _exit(1);
+            vsstats(&st);
+        }
+        _exit(0); // a is still open, its last 100 bytes buffered
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(vsmount(vdiskname) == 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(vsfsck(0, 1) == 0);
+    int fd = vsopen("a", MODE_READ);
+    CHECK(fd != -1);
+    int size = vssize(fd);
+    vsclose(fd);
+    CHECK(size == BLOCKSIZE + 100);
+    CHECK(holds("a", 0, 'A', size));
+    return 0;
+}
+
+struct {
+    const char *name;
+    int (*run)();
+} cases[] = {
+    { "append_to_read_fd", append_to_read_fd },
+    { "read_after_append", read_after_append },
+    { "append_near_int_max", append_near_int_max },
+    { "delete_open_file", delete_open_file },
+    { "crash_after_delete", crash_after_delete },
+    { "crash_after_group_commit", crash_after_group_commit },
+};
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        printf("usage: vstest <vdiskname>\n");
+        exit(2);
+    }
+    snprintf(vdiskname, sizeof(vdiskname), "%s", argv[1]);
+
+    int failed = 0;
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        for (int flags = 0; flags <= FORMAT_EXTENTS; flags += FORMAT_EXTENTS) {
+            if (vsformatx(vdiskname, 22, flags) != 0 || vsmount(vdiskname) != 0) {
+                printf("could not set up %s\n", vdiskname);
+                exit(2);
+            }
+            int ret = cases[i].run();
+            if (vsumount() != 0)
+                ret = -1;
+            printf("%s%s: %s\n", cases[i].name, flags ? " (extents)" : "", ret == 0 ? "ok" : "FAILED");
+            if (ret != 0)
+                failed++;
+        }
+    }
+    return failed > 0;
+}